@@ -1,2 +0,0 @@
-bool evaluateNesting(std::string nesting);
-
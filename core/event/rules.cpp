@@ -0,0 +1,812 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <ctype.h>
+
+#include <iostream>
+
+#include "agoclient.h"
+#include "rules.h"
+
+using namespace std;
+using namespace agocontrol;
+using namespace qpid::types;
+
+static double variantToDouble(const Variant &v) {
+	double result;
+	switch(v.getType()) {
+		case VAR_DOUBLE:
+			result = v.asDouble();
+			break;
+		case VAR_FLOAT:
+			result = v.asFloat();
+			break;
+		case VAR_BOOL:
+			result = v.asBool();
+			break;
+		case VAR_STRING:
+			result = atof(v.getString().c_str());
+			break;
+		case VAR_INT8:
+			result = v.asInt8();
+			break;
+		case VAR_INT16:
+			result = v.asInt16();
+			break;
+		case VAR_INT32:
+			result = v.asInt32();
+			break;
+		case VAR_INT64:
+			result = v.asInt64();
+			break;
+		case VAR_UINT8:
+			result = v.asUint8();
+			break;
+		case VAR_UINT16:
+			result = v.asUint16();
+			break;
+		case VAR_UINT32:
+			result = v.asUint32();
+			break;
+		case VAR_UINT64:
+			result = v.asUint64();
+			break;
+		default:
+			cout << "ERROR! No conversion for type:" << v << endl;
+			result = 0;
+	}
+	return result;
+}
+
+// eq compares as string when either side is a string, the common combinations use the converted rval
+// instead of formatting the values
+static bool compareEqual(const Variant &lval, const Criterion &criterion) {
+	const Variant &rval = criterion.rval;
+	if (lval.getType() == VAR_STRING) {
+		if (criterion.textual) return lval.getString() == criterion.text;
+	} else if (rval.getType() == VAR_STRING) {
+		switch (lval.getType()) {
+			case VAR_VOID:
+				return criterion.text.empty();
+			case VAR_BOOL:
+				return criterion.text == (lval.asBool() ? "True" : "False");
+			case VAR_INT16:
+			case VAR_INT32:
+			case VAR_INT64:
+				if (criterion.integral) return lval.asInt64() == criterion.integer;
+				break;
+			case VAR_UINT16:
+			case VAR_UINT32:
+			case VAR_UINT64:
+				if (criterion.integral) return criterion.integer >= 0 && lval.asUint64() == (uint64_t)criterion.integer;
+				break;
+			default:
+				break;
+		}
+	} else {
+		return lval.isEqualTo(rval);
+	}
+	return lval.asString() == rval.asString();
+}
+
+static bool compare(const Variant &lval, const Criterion &criterion) {
+	switch (criterion.comp) {
+		case COMP_EQ:
+			return compareEqual(lval, criterion);
+		case COMP_LT:
+			return variantToDouble(lval) < criterion.number;
+		case COMP_GT:
+			return variantToDouble(lval) > criterion.number;
+		case COMP_LTE:
+			return !(variantToDouble(lval) > criterion.number);
+		case COMP_GTE:
+			return !(variantToDouble(lval) < criterion.number);
+		default:
+			return false;
+	}
+}
+
+// recursive descent parser for nesting expressions like (criteria["0"] and !criteria[1]) | true.
+// and/& binds stronger than or/|, criteria references are resolved to criterion indices.
+class NestingParser {
+	public:
+		NestingParser(const std::string &text, const std::map<std::string, int> &criteria, std::vector<NestingNode> &nodes)
+			: pos(text.c_str()), criteria(criteria), nodes(nodes) {}
+		bool parse(int &root, std::string &error) {
+			if (!parseOr(root)) {
+				error = this->error;
+				return false;
+			}
+			skipSpace();
+			if (*pos == ';') pos++; // legacy terminator
+			skipSpace();
+			if (*pos != '\0') {
+				error = std::string("unexpected '") + pos + "'";
+				return false;
+			}
+			return true;
+		}
+	private:
+		const char *pos;
+		const std::map<std::string, int> &criteria;
+		std::vector<NestingNode> &nodes;
+		std::string error;
+
+		void skipSpace() {
+			while (isspace((unsigned char)*pos)) pos++;
+		}
+		std::string peekWord() {
+			skipSpace();
+			const char *end = pos;
+			while (isalnum((unsigned char)*end) || *end == '_') end++;
+			return std::string(pos, end);
+		}
+		int addNode(int op, int left, int right, int criterion, bool value) {
+			NestingNode node;
+			node.op = op;
+			node.left = left;
+			node.right = right;
+			node.criterion = criterion;
+			node.value = value;
+			nodes.push_back(node);
+			return nodes.size() - 1;
+		}
+		// consume an operator given as symbol or word
+		bool accept(char symbol, const char *word) {
+			skipSpace();
+			if (*pos == symbol) {
+				pos++;
+				return true;
+			}
+			std::string next = peekWord();
+			if (next == word) {
+				pos += next.size();
+				return true;
+			}
+			return false;
+		}
+		bool parseOr(int &node) {
+			if (!parseAnd(node)) return false;
+			while (accept('|', "or")) {
+				int right;
+				if (!parseAnd(right)) return false;
+				node = addNode(NESTING_OR, node, right, -1, false);
+			}
+			return true;
+		}
+		bool parseAnd(int &node) {
+			if (!parseNot(node)) return false;
+			while (accept('&', "and")) {
+				int right;
+				if (!parseNot(right)) return false;
+				node = addNode(NESTING_AND, node, right, -1, false);
+			}
+			return true;
+		}
+		bool parseNot(int &node) {
+			skipSpace();
+			if (*pos == '!') {
+				pos++;
+				int operand;
+				if (!parseNot(operand)) return false;
+				node = addNode(NESTING_NOT, operand, -1, -1, false);
+				return true;
+			}
+			return parsePrimary(node);
+		}
+		bool parsePrimary(int &node) {
+			skipSpace();
+			if (*pos == '(') {
+				pos++;
+				if (!parseOr(node)) return false;
+				skipSpace();
+				if (*pos != ')') {
+					error = "missing ')'";
+					return false;
+				}
+				pos++;
+				return true;
+			}
+			std::string word = peekWord();
+			if (word == "") {
+				error = *pos == '\0' ? "unexpected end" : std::string("unexpected '") + pos + "'";
+				return false;
+			}
+			pos += word.size();
+			if (word == "criteria") return parseCriterion(node);
+			if (word == "true" || word == "True" || word == "T" || word == "t" || word == "1") {
+				node = addNode(NESTING_CONST, -1, -1, -1, true);
+			} else if (word == "false" || word == "False" || word == "F" || word == "f" || word == "0") {
+				node = addNode(NESTING_CONST, -1, -1, -1, false);
+			} else {
+				error = "unknown identifier " + word;
+				return false;
+			}
+			return true;
+		}
+		// criteria["key"] or criteria[key], the word criteria is already consumed
+		bool parseCriterion(int &node) {
+			skipSpace();
+			if (*pos != '[') {
+				error = "expected '[' after criteria";
+				return false;
+			}
+			pos++;
+			bool quoted = *pos == '"';
+			if (quoted) pos++;
+			const char *start = pos;
+			while (*pos != '\0' && *pos != ']' && *pos != '"') pos++;
+			std::string key(start, pos);
+			if (quoted) {
+				if (*pos != '"') {
+					error = "unterminated criteria key";
+					return false;
+				}
+				pos++;
+			}
+			if (*pos != ']') {
+				error = "expected ']' after criteria key";
+				return false;
+			}
+			pos++;
+			std::map<std::string, int>::const_iterator it = criteria.find(key);
+			if (it == criteria.end()) {
+				error = "unknown criteria " + key;
+				return false;
+			}
+			node = addNode(NESTING_CRITERION, -1, -1, it->second, false);
+			return true;
+		}
+};
+
+static bool compileCriterion(const Variant::Map &element, Criterion &criterion, std::string &error) {
+	Variant::Map::const_iterator lval = element.find("lval");
+	Variant::Map::const_iterator comp = element.find("comp");
+	Variant::Map::const_iterator rval = element.find("rval");
+
+	criterion.cached = false;
+	criterion.result = false;
+	criterion.source = SOURCE_EVENT;
+	if (lval != element.end() && lval->second.getType() == VAR_STRING) {
+		// legacy eventmap entry
+		criterion.parameter = lval->second.getString();
+	} else if (lval != element.end() && lval->second.getType() == VAR_MAP) {
+		const Variant::Map &lvalmap = lval->second.asMap();
+		Variant::Map::const_iterator type = lvalmap.find("type");
+		Variant::Map::const_iterator it;
+		std::string typeName = type != lvalmap.end() ? type->second.asString() : "";
+		if (typeName == "variable") {
+			criterion.source = SOURCE_VARIABLE;
+			if ((it = lvalmap.find("name")) != lvalmap.end()) criterion.parameter = it->second.asString();
+		} else if (typeName == "device") {
+			if ((it = lvalmap.find("uuid")) != lvalmap.end()) criterion.uuid = it->second.asString();
+			if ((it = lvalmap.find("parameter")) != lvalmap.end()) criterion.parameter = it->second.asString();
+			criterion.source = criterion.parameter == "state" ? SOURCE_DEVICESTATE : SOURCE_DEVICEVALUE;
+		} else {
+			if ((it = lvalmap.find("parameter")) != lvalmap.end()) criterion.parameter = it->second.asString();
+		}
+	} else if (lval != element.end() && !lval->second.isVoid()) {
+		error = "lval must be a string or a map";
+		return false;
+	}
+
+	std::string compName = comp != element.end() ? comp->second.asString() : "";
+	if (compName == "eq") criterion.comp = COMP_EQ;
+	else if (compName == "lt") criterion.comp = COMP_LT;
+	else if (compName == "gt") criterion.comp = COMP_GT;
+	else if (compName == "lte") criterion.comp = COMP_LTE;
+	else if (compName == "gte") criterion.comp = COMP_GTE;
+	else criterion.comp = COMP_INVALID;
+
+	if (rval != element.end()) criterion.rval = rval->second;
+	criterion.number = 0;
+	criterion.textual = false;
+	criterion.integral = false;
+	criterion.integer = 0;
+	switch (criterion.rval.getType()) {
+		case VAR_MAP:
+		case VAR_LIST:
+			break; // never equal to a scalar, not a number
+		case VAR_VOID:
+			criterion.textual = true;
+			break;
+		default:
+			if (criterion.comp != COMP_EQ && criterion.comp != COMP_INVALID) criterion.number = variantToDouble(criterion.rval);
+			criterion.text = criterion.rval.asString();
+			criterion.textual = true;
+	}
+	if (criterion.rval.getType() == VAR_STRING && !criterion.text.empty()) {
+		// only the canonical form equals an integer lval formatted as string
+		char *end;
+		long long integer = strtoll(criterion.text.c_str(), &end, 10);
+		char canonical[32];
+		snprintf(canonical, sizeof(canonical), "%lld", integer);
+		if (*end == '\0' && criterion.text == canonical) {
+			criterion.integral = true;
+			criterion.integer = integer;
+		}
+	}
+	return true;
+}
+
+bool compileRule(const std::string &uuid, const Variant::Map &event, Rule &rule, std::string &error) {
+	try {
+		Variant::Map::const_iterator it;
+		rule.uuid = uuid;
+		rule.subject = (it = event.find("event")) != event.end() ? it->second.asString() : "";
+		rule.disabled = (it = event.find("disabled")) != event.end() && !it->second.isVoid() && it->second.asBool();
+		std::string trigger = (it = event.find("trigger")) != event.end() ? it->second.asString() : "";
+		if (trigger == "" || trigger == "event") {
+			rule.trigger = TRIGGER_EVENT;
+		} else if (trigger == "edge") {
+			rule.trigger = TRIGGER_EDGE;
+		} else {
+			error = "unknown trigger " + trigger;
+			return false;
+		}
+		rule.edgeState = EDGE_UNKNOWN;
+		rule.dirty = false;
+		if ((it = event.find("action")) == event.end() || it->second.getType() != VAR_MAP) {
+			error = "action missing";
+			return false;
+		}
+		rule.action = it->second.asMap();
+
+		std::map<std::string, int> criteriaIndex;
+		if ((it = event.find("criteria")) != event.end() && !it->second.isVoid()) {
+			if (it->second.getType() != VAR_MAP) {
+				error = "criteria must be a map";
+				return false;
+			}
+			const Variant::Map &criteria = it->second.asMap();
+			for (Variant::Map::const_iterator crit = criteria.begin(); crit != criteria.end(); crit++) {
+				Criterion criterion;
+				if (crit->second.getType() != VAR_MAP) {
+					error = "criteria " + crit->first + " is not a map";
+					return false;
+				}
+				if (!compileCriterion(crit->second.asMap(), criterion, error)) {
+					error = "criteria " + crit->first + ": " + error;
+					return false;
+				}
+				criteriaIndex[crit->first] = rule.criteria.size();
+				rule.criteria.push_back(criterion);
+			}
+		}
+
+		if (rule.trigger == TRIGGER_EDGE) {
+			// there is no triggering event whose parameters could be compared
+			for (size_t i = 0; i < rule.criteria.size(); i++) {
+				if (rule.criteria[i].source == SOURCE_EVENT) {
+					error = "edge rules can only use device and variable criteria";
+					return false;
+				}
+			}
+		}
+
+		std::string nesting = (it = event.find("nesting")) != event.end() ? it->second.asString() : "";
+		NestingParser parser(nesting, criteriaIndex, rule.nesting);
+		if (!parser.parse(rule.root, error)) {
+			error = "nesting: " + error;
+			return false;
+		}
+	} catch (const std::exception &e) {
+		error = e.what();
+		return false;
+	}
+	return true;
+}
+
+// left side of a device or variable criterion, false when the device or value doesn't exist
+static bool criterionValue(const Criterion &criterion, InventoryCache *inventory, Variant &lval) {
+	switch (criterion.source) {
+		case SOURCE_VARIABLE:
+			inventory->getVariable(criterion.parameter, lval);
+			return true;
+		case SOURCE_DEVICESTATE:
+		case SOURCE_DEVICEVALUE: {
+			Variant::Map device;
+			if (!inventory->getDevice(criterion.uuid, device)) {
+				cout << "ERROR: unknown device " << criterion.uuid << endl;
+				return false;
+			}
+			if (criterion.source == SOURCE_DEVICESTATE) {
+				lval = device["state"];
+				return true;
+			}
+			Variant::Map::const_iterator values = device.find("values");
+			if (values == device.end() || values->second.getType() != VAR_MAP) return false;
+			Variant::Map::const_iterator value = values->second.asMap().find(criterion.parameter);
+			if (value == values->second.asMap().end() || value->second.getType() != VAR_MAP) return false;
+			Variant::Map::const_iterator level = value->second.asMap().find("level");
+			if (level != value->second.asMap().end()) lval = level->second;
+			return true;
+		}
+		default:
+			return false;
+	}
+}
+
+static bool evaluateCriterion(Criterion &criterion, const Variant::Map &content, InventoryCache *inventory) {
+	if (criterion.cached) return criterion.result;
+	bool result = false;
+	try {
+		if (criterion.source == SOURCE_EVENT) {
+			// compared in place, missing parameters as void
+			static const Variant none;
+			Variant::Map::const_iterator it = content.find(criterion.parameter);
+			result = compare(it != content.end() ? it->second : none, criterion);
+		} else {
+			Variant lval;
+			if (criterionValue(criterion, inventory, lval)) result = compare(lval, criterion);
+		}
+	} catch (const std::exception &error) {
+		cout << "ERROR, exception occured" << error.what() << endl;
+	}
+	if (criterion.source != SOURCE_EVENT) {
+		criterion.cached = true;
+		criterion.result = result;
+	}
+	return result;
+}
+
+static bool evaluateNode(Rule &rule, int index, const Variant::Map &content, InventoryCache *inventory) {
+	const NestingNode &node = rule.nesting[index];
+	switch (node.op) {
+		case NESTING_CONST:
+			return node.value;
+		case NESTING_CRITERION:
+			return evaluateCriterion(rule.criteria[node.criterion], content, inventory);
+		case NESTING_NOT:
+			return !evaluateNode(rule, node.left, content, inventory);
+		case NESTING_AND:
+			return evaluateNode(rule, node.left, content, inventory) && evaluateNode(rule, node.right, content, inventory);
+		default:
+			return evaluateNode(rule, node.left, content, inventory) || evaluateNode(rule, node.right, content, inventory);
+	}
+}
+
+// dependency key of a criterion, "" for event parameters
+static std::string dependencyKey(const Criterion &criterion) {
+	switch (criterion.source) {
+		case SOURCE_DEVICESTATE:
+		case SOURCE_DEVICEVALUE:
+			return "device:" + criterion.uuid;
+		case SOURCE_VARIABLE:
+			return "variable:" + criterion.parameter;
+		default:
+			return "";
+	}
+}
+
+RuleEngine::RuleEngine() {
+	inventorySequence = 0;
+	pthread_mutex_init(&mutex, NULL);
+}
+
+RuleEngine::~RuleEngine() {
+	for (std::map<std::string, Rule*>::iterator it = rules.begin(); it != rules.end(); it++) delete it->second;
+	pthread_mutex_destroy(&mutex);
+}
+
+void RuleEngine::load(const Variant::Map &eventmap) {
+	pthread_mutex_lock(&mutex);
+	for (std::map<std::string, Rule*>::iterator it = rules.begin(); it != rules.end(); it++) delete it->second;
+	rules.clear();
+	bySubject.clear();
+	dependents.clear();
+	dirtyRules.clear();
+	pthread_mutex_unlock(&mutex);
+	for (Variant::Map::const_iterator it = eventmap.begin(); it != eventmap.end(); it++) {
+		std::string error;
+		if (it->second.getType() != VAR_MAP) {
+			cout << "ERROR: eventmap entry " << it->first << " is not a map" << endl;
+		} else if (!setRule(it->first, it->second.asMap(), error)) {
+			cout << "ERROR: can't compile event " << it->first << ": " << error << endl;
+		}
+	}
+}
+
+bool RuleEngine::setRule(const std::string &uuid, const Variant::Map &event, std::string &error) {
+	Rule *rule = new Rule;
+	bool result = compileRule(uuid, event, *rule, error);
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, Rule*>::iterator it = rules.find(uuid);
+	if (it != rules.end()) {
+		unindex(it->second);
+		delete it->second;
+		rules.erase(it);
+	}
+	if (result) {
+		rules[uuid] = rule;
+		index(rule);
+	}
+	pthread_mutex_unlock(&mutex);
+	if (!result) delete rule;
+	return result;
+}
+
+void RuleEngine::removeRule(const std::string &uuid) {
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, Rule*>::iterator it = rules.find(uuid);
+	if (it != rules.end()) {
+		unindex(it->second);
+		delete it->second;
+		rules.erase(it);
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void RuleEngine::index(Rule *rule) {
+	if (rule->trigger == TRIGGER_EVENT) bySubject[rule->subject].push_back(rule);
+	for (size_t i = 0; i < rule->criteria.size(); i++) {
+		std::string key = dependencyKey(rule->criteria[i]);
+		if (key == "") continue;
+		Dependency dependency;
+		dependency.rule = rule;
+		dependency.criterion = i;
+		dependents[key].push_back(dependency);
+	}
+	if (rule->trigger == TRIGGER_EDGE) {
+		// establishes the initial state on the next event
+		rule->dirty = true;
+		dirtyRules.push_back(rule);
+	}
+}
+
+void RuleEngine::unindex(Rule *rule) {
+	boost::unordered_map<std::string, std::vector<Rule*> >::iterator it = bySubject.find(rule->subject);
+	if (it != bySubject.end()) {
+		for (std::vector<Rule*>::iterator entry = it->second.begin(); entry != it->second.end(); entry++) {
+			if (*entry == rule) {
+				it->second.erase(entry);
+				break;
+			}
+		}
+		if (it->second.empty()) bySubject.erase(it);
+	}
+	for (size_t i = 0; i < rule->criteria.size(); i++) {
+		boost::unordered_map<std::string, std::vector<Dependency> >::iterator deps = dependents.find(dependencyKey(rule->criteria[i]));
+		if (deps == dependents.end()) continue;
+		for (std::vector<Dependency>::iterator entry = deps->second.begin(); entry != deps->second.end(); ) {
+			if (entry->rule == rule) entry = deps->second.erase(entry);
+			else entry++;
+		}
+		if (deps->second.empty()) dependents.erase(deps);
+	}
+	if (rule->dirty) {
+		for (std::vector<Rule*>::iterator entry = dirtyRules.begin(); entry != dirtyRules.end(); entry++) {
+			if (*entry == rule) {
+				dirtyRules.erase(entry);
+				break;
+			}
+		}
+	}
+}
+
+// a device or variable changed: forget the results of the criteria reading it
+void RuleEngine::changed(const std::string &key) {
+	boost::unordered_map<std::string, std::vector<Dependency> >::iterator it = dependents.find(key);
+	if (it == dependents.end()) return;
+	for (std::vector<Dependency>::iterator dependency = it->second.begin(); dependency != it->second.end(); dependency++) {
+		dependency->rule->criteria[dependency->criterion].cached = false;
+		if (dependency->rule->trigger == TRIGGER_EDGE && !dependency->rule->dirty) {
+			dependency->rule->dirty = true;
+			dirtyRules.push_back(dependency->rule);
+		}
+	}
+}
+
+// the replica was synced with the resolver, any value may have changed
+void RuleEngine::invalidateAll() {
+	for (boost::unordered_map<std::string, std::vector<Dependency> >::iterator it = dependents.begin(); it != dependents.end(); it++) {
+		changed(it->first);
+	}
+}
+
+void RuleEngine::handleChanges(const std::string &subject, const Variant::Map &content, InventoryCache *inventory, std::vector<Variant::Map> &actions) {
+	Variant::Map::const_iterator it;
+	uint64_t sequence = inventory->getSequence();
+	std::string epoch = inventory->getEpoch();
+
+	pthread_mutex_lock(&mutex);
+	if (sequence != inventorySequence || epoch != inventoryEpoch) {
+		inventorySequence = sequence;
+		inventoryEpoch = epoch;
+		invalidateAll();
+	}
+	// what the replica changed for this event, see InventoryCache::handleEvent()
+	if ((it = content.find("uuid")) != content.end()) changed("device:" + it->second.asString());
+	if (subject == "event.device.announcelist" && (it = content.find("devices")) != content.end() && it->second.getType() == VAR_MAP) {
+		for (Variant::Map::const_iterator device = it->second.asMap().begin(); device != it->second.asMap().end(); device++) {
+			changed("device:" + device->first);
+		}
+	} else if (subject == "event.environment.timechanged") {
+		const char *names[] = { "hour", "day", "weekday", "minute", "month" };
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) changed(std::string("variable:") + names[i]);
+	} else if (subject == "event.system.variablechanged" || subject == "event.system.variabledeleted") {
+		if ((it = content.find("variable")) != content.end()) changed("variable:" + it->second.asString());
+	}
+
+	// edge rules only start once the replica holds an inventory, its first sync would look like a change
+	if (sequence != 0 || epoch != "") {
+		Variant::Map none;
+		std::vector<Rule*> dirty;
+		dirty.swap(dirtyRules);
+		for (std::vector<Rule*>::iterator rule = dirty.begin(); rule != dirty.end(); rule++) {
+			(*rule)->dirty = false;
+			if ((*rule)->disabled) continue;
+			bool result = evaluateNode(**rule, (*rule)->root, none, inventory);
+			if (result && (*rule)->edgeState == EDGE_FALSE) {
+				cout << "event " << (*rule)->uuid << " became true after " << subject << endl;
+				actions.push_back((*rule)->action);
+			}
+			(*rule)->edgeState = result ? EDGE_TRUE : EDGE_FALSE;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+void RuleEngine::handleEvent(const std::string &subject, const Variant::Map &content, InventoryCache *inventory, std::vector<Variant::Map> &actions) {
+	pthread_mutex_lock(&mutex);
+	boost::unordered_map<std::string, std::vector<Rule*> >::const_iterator it = bySubject.find(subject);
+	if (it != bySubject.end()) {
+		for (std::vector<Rule*>::const_iterator rule = it->second.begin(); rule != it->second.end(); rule++) {
+			if ((*rule)->disabled) continue;
+			if (evaluateNode(**rule, (*rule)->root, content, inventory)) {
+				cout << "event " << (*rule)->uuid << " triggered by " << subject << endl;
+				actions.push_back((*rule)->action);
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+#ifdef RULES_BENCH
+// g++ -DRULES_BENCH -I. -I../../shared rules.cpp ../../shared/agoclient.cpp ../../shared/CDataFile.cpp -lqpidmessaging -lqpidtypes -luuid -ljsoncpp -lpthread
+// evaluates a 5000 rule eventmap, the criteria compared with the typed kernel and with the former by-value implementation
+
+#include <sys/time.h>
+
+static double legacyVariantToDouble(qpid::types::Variant v) {
+	if (v.getType() == VAR_STRING) return atof(v.getString().c_str());
+	return variantToDouble(v);
+}
+
+static bool legacyCompare(Variant lval, int comp, Variant rval) {
+	switch (comp) {
+		case COMP_EQ:
+			if (lval.getType() == VAR_STRING || rval.getType() == VAR_STRING) return lval.asString() == rval.asString();
+			return lval.isEqualTo(rval);
+		case COMP_LT: return legacyVariantToDouble(lval) < legacyVariantToDouble(rval);
+		case COMP_GT: return legacyVariantToDouble(lval) > legacyVariantToDouble(rval);
+		case COMP_LTE: return !(legacyVariantToDouble(lval) > legacyVariantToDouble(rval));
+		case COMP_GTE: return !(legacyVariantToDouble(lval) < legacyVariantToDouble(rval));
+		default: return false;
+	}
+}
+
+static double elapsed(const struct timeval &start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0;
+}
+
+static Variant::Map criterion(const Variant &lval, const char *comp, const Variant &rval) {
+	Variant::Map result;
+	result["lval"] = lval;
+	result["comp"] = comp;
+	result["rval"] = rval;
+	return result;
+}
+
+int main(int argc, char **argv) {
+	const int subjects = 50;
+	const int count = 5000;
+
+	// the replica holds one device per subject
+	Variant::Map devices;
+	for (int i = 0; i < subjects; i++) {
+		Variant::Map device;
+		device["state"] = "255";
+		device["values"] = Variant::Map();
+		devices["device" + int2str(i)] = device;
+	}
+	Variant::Map reply;
+	reply["devices"] = devices;
+	reply["variables"] = Variant::Map();
+	reply["sequence"] = (uint64_t)1;
+	reply["epoch"] = "bench";
+	InventoryCache inventory;
+	inventory.apply(reply);
+
+	// eventmap entries as written by the web interface, constants are strings
+	RuleEngine engine;
+	std::vector<Rule> compiled;
+	for (int i = 0; i < count; i++) {
+		Variant::Map event, criteria, action, device;
+		std::string subject = "event.environment.bench" + int2str(i % subjects) + "changed";
+		device["type"] = "device";
+		device["uuid"] = "device" + int2str(i % subjects);
+		device["parameter"] = "state";
+		criteria["0"] = criterion("level", "gt", int2str(i % 100));
+		criteria["1"] = criterion("unit", "eq", "degC");
+		criteria["2"] = criterion("count", "eq", int2str(i % 7));
+		criteria["3"] = criterion(device, "eq", "255");
+		action["command"] = "on";
+		action["uuid"] = "target" + int2str(i);
+		event["event"] = subject;
+		event["criteria"] = criteria;
+		event["nesting"] = "(criteria[\"0\"] and criteria[\"1\"] and criteria[\"2\"]) or !criteria[\"3\"]";
+		event["action"] = action;
+		std::string error;
+		Rule rule;
+		if (!compileRule(int2str(i), event, rule, error) || !engine.setRule(int2str(i), event, error)) {
+			std::cout << "rule " << i << ": " << error << std::endl;
+			return 1;
+		}
+		compiled.push_back(rule);
+	}
+
+	std::vector<Variant::Map> contents;
+	for (int i = 0; i < subjects; i++) {
+		Variant::Map content;
+		content["level"] = 50.5;
+		content["unit"] = "degC";
+		content["count"] = i % 7;
+		content["uuid"] = "sensor";
+		contents.push_back(content);
+	}
+
+	const int rounds = argc > 1 ? atoi(argv[1]) : 20;
+	struct timeval start;
+	size_t legacyMatches = 0, typedMatches = 0;
+
+	// every event criterion against the content of its subject
+	gettimeofday(&start, NULL);
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < count; i++) {
+			const Variant::Map &content = contents[i % subjects];
+			for (size_t c = 0; c < compiled[i].criteria.size(); c++) {
+				const Criterion &crit = compiled[i].criteria[c];
+				if (crit.source != SOURCE_EVENT) continue;
+				Variant::Map::const_iterator it = content.find(crit.parameter);
+				if (legacyCompare(it != content.end() ? it->second : Variant(), crit.comp, crit.rval)) legacyMatches++;
+			}
+		}
+	}
+	double legacy = elapsed(start) / rounds;
+
+	gettimeofday(&start, NULL);
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < count; i++) {
+			const Variant::Map &content = contents[i % subjects];
+			for (size_t c = 0; c < compiled[i].criteria.size(); c++) {
+				const Criterion &crit = compiled[i].criteria[c];
+				if (crit.source != SOURCE_EVENT) continue;
+				Variant::Map::const_iterator it = content.find(crit.parameter);
+				if (compare(it != content.end() ? it->second : Variant(), crit)) typedMatches++;
+			}
+		}
+	}
+	double typed = elapsed(start) / rounds;
+
+	// the whole engine, one event per subject
+	size_t fired = 0;
+	gettimeofday(&start, NULL);
+	for (int r = 0; r < rounds; r++) {
+		for (int i = 0; i < subjects; i++) {
+			std::vector<Variant::Map> actions;
+			engine.handleChanges("event.environment.bench" + int2str(i) + "changed", contents[i], &inventory, actions);
+			engine.handleEvent("event.environment.bench" + int2str(i) + "changed", contents[i], &inventory, actions);
+			fired += actions.size();
+		}
+	}
+	double events = elapsed(start) / rounds;
+
+	std::cout << count << " rules, matches legacy " << legacyMatches << " typed " << typedMatches << std::endl;
+	std::cout << "legacy compare: " << legacy << " ms" << std::endl;
+	std::cout << "typed compare:  " << typed << " ms" << std::endl;
+	std::cout << "engine: " << events << " ms for " << subjects << " events, " << fired / rounds << " actions" << std::endl;
+	return legacyMatches == typedMatches ? 0 : 1;
+}
+#endif
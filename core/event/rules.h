@@ -0,0 +1,123 @@
+#include <string>
+#include <vector>
+#include <map>
+
+#include <pthread.h>
+
+#include <boost/unordered_map.hpp>
+
+#include <qpid/types/Variant.h>
+
+namespace agocontrol {
+	class InventoryCache;
+}
+
+// where the left side of a criterion comes from
+#define SOURCE_EVENT 0
+#define SOURCE_DEVICESTATE 1
+#define SOURCE_DEVICEVALUE 2
+#define SOURCE_VARIABLE 3
+
+#define COMP_EQ 0
+#define COMP_LT 1
+#define COMP_GT 2
+#define COMP_LTE 3
+#define COMP_GTE 4
+#define COMP_INVALID 5 // unknown operator, never true
+
+// event rules are evaluated when their subject arrives, edge rules whenever a device or variable they
+// read changes, they fire when their condition turns from false to true
+#define TRIGGER_EVENT 0
+#define TRIGGER_EDGE 1
+
+#define EDGE_UNKNOWN -1 // not evaluated yet, the first result never fires
+#define EDGE_FALSE 0
+#define EDGE_TRUE 1
+
+#define NESTING_CONST 0
+#define NESTING_CRITERION 1
+#define NESTING_NOT 2
+#define NESTING_AND 3
+#define NESTING_OR 4
+
+/// a criterion of a rule: an event parameter, device state or value or a global variable compared with a constant.
+struct Criterion {
+	int source;
+	std::string uuid; // device for SOURCE_DEVICESTATE and SOURCE_DEVICEVALUE
+	std::string parameter; // event parameter, device value or variable name
+	int comp;
+	qpid::types::Variant rval;
+	// rval converted once when the rule is compiled
+	double number; // for lt/gt/lte/gte
+	bool textual; // text holds rval as a string
+	std::string text;
+	bool integral; // rval is a string holding the decimal form of integer
+	int64_t integer;
+	bool cached; // result holds the outcome for the current device or variable value
+	bool result;
+};
+
+/// node of a compiled nesting expression, operands are indices of other nodes of the same rule.
+struct NestingNode {
+	int op;
+	int left; // also the operand of NESTING_NOT
+	int right;
+	int criterion; // index into Rule::criteria for NESTING_CRITERION
+	bool value; // NESTING_CONST
+};
+
+/// an eventmap entry compiled for evaluation.
+struct Rule {
+	std::string uuid;
+	std::string subject;
+	int trigger;
+	int edgeState; // last result of an edge rule
+	bool dirty; // edge rule waiting for re-evaluation
+	bool disabled;
+	std::vector<Criterion> criteria;
+	std::vector<NestingNode> nesting;
+	int root;
+	qpid::types::Variant::Map action;
+};
+
+/// a criterion reading a device or variable, see RuleEngine::dependents.
+struct Dependency {
+	Rule *rule;
+	int criterion;
+};
+
+/// the eventmap compiled once when it is loaded or changed. rules are indexed by their trigger subject
+/// and their nesting expression is evaluated as a tree, criteria only when the expression needs them.
+/// results of device and variable criteria are cached until an event changes what they read.
+class RuleEngine {
+	public:
+		RuleEngine();
+		~RuleEngine();
+		/// compile all entries of an eventmap, replacing the current rules. entries that can't be compiled are left out.
+		void load(const qpid::types::Variant::Map &eventmap);
+		/// compile an eventmap entry and add it, or replace the rule with the same uuid. returns false with the
+		/// reason in error when it can't be compiled, the rule is then inactive until it is set again.
+		bool setRule(const std::string &uuid, const qpid::types::Variant::Map &event, std::string &error);
+		void removeRule(const std::string &uuid);
+		/// drop the cached results the event invalidates and re-evaluate the edge rules depending on them.
+		/// call it for every event after the inventory replica has seen it, before handleEvent().
+		void handleChanges(const std::string &subject, const qpid::types::Variant::Map &content, agocontrol::InventoryCache *inventory, std::vector<qpid::types::Variant::Map> &actions);
+		/// evaluate the rules triggered by an event, the actions of the rules which fire are appended to actions.
+		void handleEvent(const std::string &subject, const qpid::types::Variant::Map &content, agocontrol::InventoryCache *inventory, std::vector<qpid::types::Variant::Map> &actions);
+	protected:
+		std::map<std::string, Rule*> rules; // uuid -> rule
+		boost::unordered_map<std::string, std::vector<Rule*> > bySubject;
+		// "device:<uuid>" or "variable:<name>" -> criteria reading it
+		boost::unordered_map<std::string, std::vector<Dependency> > dependents;
+		std::vector<Rule*> dirtyRules;
+		uint64_t inventorySequence; // replica state the cached results belong to
+		std::string inventoryEpoch;
+		pthread_mutex_t mutex;
+		void index(Rule *rule);
+		void unindex(Rule *rule);
+		void changed(const std::string &key);
+		void invalidateAll();
+};
+
+/// compile an eventmap entry, returns false with the reason in error if it is malformed.
+bool compileRule(const std::string &uuid, const qpid::types::Variant::Map &event, Rule &rule, std::string &error);
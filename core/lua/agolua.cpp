@@ -215,7 +215,7 @@ void pushTableFromMap(lua_State *L, qpid::types::Variant::Map content) {
 
 bool runScript(qpid::types::Variant::Map content, const char *script) {
 	cout << "-- running script " << script <<  endl;
-	inventory = agoConnection->getInventory();
+	inventory = agoConnection->getInventoryCache()->getInventory();
 	lua_State *L;    
 	const luaL_Reg *lib;
 
@@ -341,7 +341,7 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 }
 
 void eventHandler(std::string subject, qpid::types::Variant::Map content) {
-	if (subject == "event.device.announce") return;
+	if (subject == "event.device.announce" || subject == "event.device.announcelist") return;
 	content["subject"]=subject;
 	commandHandler(content);
 }
@@ -21,6 +21,8 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <pthread.h>
+#include <signal.h>
+#include <sys/time.h>
 #ifndef __FreeBSD__
 #include <sys/sysinfo.h>
 #endif
@@ -53,6 +55,10 @@
 #define DEVICESMAPFILE CONFDIR "/maps/devices.json"
 #endif
 
+#ifndef SCHEMASNAPSHOTFILE
+#define SCHEMASNAPSHOTFILE CONFDIR "/maps/schema.snapshot"
+#endif
+
 #include "schema.h"
 #include "inventory.h"
 
@@ -67,17 +73,145 @@ AgoConnection *agoConnection;
 
 Variant::Map inventory; // used to hold device registrations
 Variant::Map schema;  
+SchemaIndex schemaIndex; // schema compiled for validatecommand
+std::string schemaVersion; // content hash of schema
 Variant::Map systeminfo; // holds system information
 Variant::Map variables; // holds global variables
 Variant::Map environment; // holds global environment like position, weather conditions, ..
 
 Inventory *inv;
 unsigned int discoverdelay;
+// discovery: after one broadcast at startup the discover thread wakes every discoverinterval
+// seconds and asks at most discovertargets drivers whose devices were not announced for
+// discoverdelay seconds. drivers spread their answers over discoverjitter seconds.
+unsigned int discoverinterval;
+unsigned int discoverjitter;
+unsigned int discovertargets;
+std::map<std::string, time_t> discoverRequested; // handled-by -> last targeted discover, discover thread only
 bool persistence = false;
 
-bool saveDevicemap() {
-	if (persistence) return variantMapToJSONFile(inventory, DEVICESMAPFILE);
-	return true;
+// write-behind persistence of the device map. handlers only mark the map dirty,
+// the persistence thread writes it after persistinterval seconds or as soon as
+// persistthreshold changes have piled up.
+pthread_mutex_t inventoryMutex; // guards inventory and dirtyCount
+pthread_mutex_t persistMutex; // serializes writes of the devices file
+pthread_cond_t persistCond;
+unsigned int dirtyCount = 0;
+unsigned int persistInterval = 30;
+unsigned int persistThreshold = 500;
+
+// holds inventoryMutex for its lifetime, so a throwing conversion in a handler can't leave it locked
+class InventoryLock {
+	public:
+		InventoryLock() { pthread_mutex_lock(&inventoryMutex); }
+		~InventoryLock() { pthread_mutex_unlock(&inventoryMutex); }
+};
+
+// inventory versioning. every change bumps inventorySequence, devices and sections
+// remember the sequence of their last change so getinventorydelta can answer with
+// only what changed since a given sequence. all of it is guarded by inventoryMutex.
+#define MAXTOMBSTONES 1000
+uint64_t inventorySequence = 0;
+std::string inventoryEpoch; // new on every start, sequences only compare within one epoch
+std::map<std::string, uint64_t> deviceSequence; // uuid -> sequence of last change
+std::map<uint64_t, std::string> deviceChanges; // sequence -> uuid, one entry per device
+std::map<uint64_t, std::string> deviceRemovals; // sequence -> uuid of removed devices
+uint64_t tombstoneHorizon = 0; // removals up to this sequence have been forgotten
+uint64_t roomsSequence = 0;
+uint64_t floorplansSequence = 0;
+uint64_t variablesSequence = 0;
+uint64_t environmentSequence = 0;
+
+void deviceChanged(const std::string &uuid) {
+	std::map<std::string, uint64_t>::iterator it = deviceSequence.find(uuid);
+	if (it != deviceSequence.end()) deviceChanges.erase(it->second);
+	uint64_t sequence = ++inventorySequence;
+	deviceSequence[uuid] = sequence;
+	deviceChanges[sequence] = uuid;
+}
+
+void deviceRemoved(const std::string &uuid) {
+	std::map<std::string, uint64_t>::iterator it = deviceSequence.find(uuid);
+	if (it != deviceSequence.end()) {
+		deviceChanges.erase(it->second);
+		deviceSequence.erase(it);
+	}
+	deviceRemovals[++inventorySequence] = uuid;
+	while (deviceRemovals.size() > MAXTOMBSTONES) {
+		tombstoneHorizon = deviceRemovals.begin()->first;
+		deviceRemovals.erase(deviceRemovals.begin());
+	}
+}
+
+void sectionChanged(uint64_t &sequence) {
+	sequence = ++inventorySequence;
+}
+
+// note a change of the device map, inventoryMutex must be held
+void saveDevicemap() {
+	if (!persistence) return;
+	if (++dirtyCount >= persistThreshold) pthread_cond_signal(&persistCond);
+}
+
+// write the device map if it changed since the last flush
+bool flushDevicemap() {
+	if (!persistence) return true;
+	pthread_mutex_lock(&persistMutex);
+	pthread_mutex_lock(&inventoryMutex);
+	if (dirtyCount == 0) {
+		pthread_mutex_unlock(&inventoryMutex);
+		pthread_mutex_unlock(&persistMutex);
+		return true;
+	}
+	Variant::Map snapshot = inventory;
+	unsigned int flushed = dirtyCount;
+	dirtyCount = 0;
+	pthread_mutex_unlock(&inventoryMutex);
+
+	bool result = variantMapToJSONFile(snapshot, DEVICESMAPFILE);
+	if (!result) {
+		// keep the changes pending, the next flush retries
+		pthread_mutex_lock(&inventoryMutex);
+		dirtyCount += flushed;
+		pthread_mutex_unlock(&inventoryMutex);
+	}
+	pthread_mutex_unlock(&persistMutex);
+	return result;
+}
+
+void *persistDevicemap(void *param) {
+	pthread_mutex_lock(&inventoryMutex);
+	while (true) {
+		struct timeval now;
+		struct timespec deadline;
+		gettimeofday(&now, NULL);
+		deadline.tv_sec = now.tv_sec + persistInterval;
+		deadline.tv_nsec = now.tv_usec * 1000;
+		while (dirtyCount < persistThreshold) {
+			if (pthread_cond_timedwait(&persistCond, &inventoryMutex, &deadline) == ETIMEDOUT) break;
+		}
+		if (dirtyCount > 0) {
+			pthread_mutex_unlock(&inventoryMutex);
+			flushDevicemap();
+			pthread_mutex_lock(&inventoryMutex);
+		}
+	}
+	return NULL;
+}
+
+// waits for SIGTERM/SIGINT so pending device map changes are written before exiting
+void *shutdownHandler(void *param) {
+	sigset_t *signals = (sigset_t *)param;
+	int sig;
+	sigwait(signals, &sig);
+	clog << agocontrol::kLogNotice << "received signal " << sig << ", writing device map and exiting" << std::endl;
+	flushDevicemap();
+	// the qpid and persistence threads are still running, exit() would run static destructors under them
+	std::cout.flush();
+	std::clog.flush();
+	fflush(NULL);
+	_exit(0);
+	return NULL;
 }
 
 void loadDevicemap() {
@@ -114,6 +248,13 @@ bool emitNameEvent(const char *uuid, const char *eventType, const char *name) {
         return agoConnection->sendMessage(eventType, content);
 }
 
+bool emitVariableEvent(const char *eventType, const std::string &variable, const qpid::types::Variant &value) {
+        Variant::Map content;
+        content["variable"] = variable;
+        if (!value.isVoid()) content["value"] = value;
+        return agoConnection->sendMessage(eventType, content);
+}
+
 bool emitFloorplanEvent(const char *uuid, const char *eventType, const char *floorplan, int x, int y) {
         Variant::Map content;
         content["uuid"] = uuid;
@@ -140,7 +281,7 @@ string valuesToString(Variant::Map *values) {
 }
 
 // handles events that update the state or values of a device
-void handleEvent(Variant::Map *device, string subject, Variant::Map *content) {
+void handleEvent(const string &uuid, Variant::Map *device, string subject, Variant::Map *content) {
 	Variant::Map *values;
 	if ((*device)["values"].isVoid())  {
 		cout << "error, device[values] is empty in handleEvent()" << endl;
@@ -151,6 +292,7 @@ void handleEvent(Variant::Map *device, string subject, Variant::Map *content) {
 		(*values)["state"] = (*content)["level"];
 		(*device)["state"]  = (*content)["level"];
 		(*device)["state"].setEncoding("utf8");
+		deviceChanged(uuid);
 		saveDevicemap();
 		// (*device)["state"]  = valuesToString(values);
 	} else if (subject == "event.environment.positionchanged") {
@@ -165,6 +307,7 @@ void handleEvent(Variant::Map *device, string subject, Variant::Map *content) {
 		value["timestamp"] = timestamp.str();
 
 		(*values)["position"] = value;
+		deviceChanged(uuid);
 		saveDevicemap();
 
 	} else if ((subject.find("event.environment.") != std::string::npos) && (subject.find("changed")!= std::string::npos)) {
@@ -182,13 +325,46 @@ void handleEvent(Variant::Map *device, string subject, Variant::Map *content) {
 		value["timestamp"] = timestamp.str();
 
 		(*values)[quantity] = value;
+		deviceChanged(uuid);
 		saveDevicemap();
 	}
 }
 
+// flag devices that were not announced for two discover cycles (plus the reply jitter) as stale
+void markStaleDevices() {
+	for (qpid::types::Variant::Map::iterator it = inventory.begin(); it != inventory.end(); it++) {
+		if (!it->second.isVoid()) {
+			qpid::types::Variant::Map *device = &it->second.asMap();
+			if (time(NULL) - (*device)["lastseen"].asUint64() > 2*discoverdelay + discoverjitter && (*device)["stale"].asString() != "1") {
+				// cout << "Stale device: " << it->first << endl;
+				(*device)["stale"] = 1;
+				deviceChanged(it->first);
+				saveDevicemap();
+			}
+		}
+	}
+}
+
+// the complete inventory reply, tagged with the sequence it represents. the schema
+// is left out when the client already holds the current version of it.
+void fillInventory(qpid::types::Variant::Map &reply, const std::string &knownSchemaVersion) {
+	reply["devices"] = inventory;
+	if (knownSchemaVersion != schemaVersion) reply["schema"] = schema;
+	reply["schemaversion"] = schemaVersion;
+	reply["rooms"] = inv->getrooms();
+	reply["floorplans"] = inv->getfloorplans();
+	get_sysinfo();
+	reply["system"] = systeminfo;
+	reply["variables"] = variables;
+	reply["environment"] = environment;
+	reply["sequence"] = inventorySequence;
+	reply["epoch"] = inventoryEpoch;
+}
+
 qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 	std::string internalid = content["internalid"].asString();
 	qpid::types::Variant::Map reply;
+	InventoryLock lock;
 	if (internalid == "agocontroller") {
 		if (content["command"] == "setroomname") {
 			string uuid = content["room"];
@@ -197,6 +373,7 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 			if (inv->setroomname(uuid, content["name"]) == 0) {
 				reply["uuid"] = uuid;
 				reply["returncode"] = 0;
+				sectionChanged(roomsSequence);
 				emitNameEvent(uuid.c_str(), "event.system.roomnamechanged", content["name"].asString().c_str());
 			} else {
 				reply["returncode"] = -1;
@@ -211,7 +388,13 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 				if (!inventory[uuid].isVoid()) {
 					device = &inventory[uuid].asMap();
 					(*device)["room"]= room;
+					deviceChanged(uuid);
+					saveDevicemap();
 				}
+				Variant::Map event;
+				event["uuid"] = uuid;
+				event["room"] = room;
+				agoConnection->sendMessage("event.system.deviceroomchanged", event);
 			} else {
 				reply["returncode"] = -1;
 			}
@@ -225,6 +408,7 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 				if (!inventory[uuid].isVoid()) {
 					device = &inventory[uuid].asMap();
 					(*device)["name"]= name;
+					deviceChanged(uuid);
 				}
 				saveDevicemap();
 				emitNameEvent(content["device"].asString().c_str(), "event.system.devicenamechanged", content["name"].asString().c_str());
@@ -234,6 +418,7 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 		} else if (content["command"] == "deleteroom") {
 			if (inv->deleteroom(content["room"]) == 0) {
 				string uuid = content["room"].asString();
+				sectionChanged(roomsSequence);
 				emitNameEvent(uuid.c_str(), "event.system.roomdeleted", "");
 				reply["returncode"] = 0;
 			} else {
@@ -246,6 +431,7 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 			if (inv->setfloorplanname(uuid, content["name"]) == 0) {
 				reply["uuid"] = uuid;
 				reply["returncode"] = 0;
+				sectionChanged(floorplansSequence);
 				emitNameEvent(content["floorplan"].asString().c_str(), "event.system.floorplannamechanged", content["name"].asString().c_str());
 			} else {
 				reply["returncode"] = -1;
@@ -253,6 +439,7 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 		} else if (content["command"] == "setdevicefloorplan") {
 			if ((content["device"].asString() != "") && (inv->setdevicefloorplan(content["device"], content["floorplan"], content["x"], content["y"]) == 0)) {
 				reply["returncode"] = 0;
+				sectionChanged(floorplansSequence);
 				emitFloorplanEvent(content["device"].asString().c_str(), "event.system.floorplandevicechanged", content["floorplan"].asString().c_str(), content["x"], content["y"]);
 			} else {
 				reply["returncode"] = -1;
@@ -261,6 +448,7 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 		} else if (content["command"] == "deletefloorplan") {
 			if (inv->deletefloorplan(content["floorplan"]) == 0) {
 				reply["returncode"] = 0;
+				sectionChanged(floorplansSequence);
 				emitNameEvent(content["floorplan"].asString().c_str(), "event.system.floorplandeleted", "");
 			} else {
 				reply["returncode"] = -1;
@@ -268,6 +456,8 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 		} else if (content["command"] == "setvariable") {
 			if (content["variable"].asString() != "" && content["value"].asString() != "") {
 				variables[content["variable"].asString()] = content["value"].asString();
+				sectionChanged(variablesSequence);
+				emitVariableEvent("event.system.variablechanged", content["variable"].asString(), content["value"].asString());
 				if (variantMapToJSONFile(variables, VARIABLESMAPFILE)) {
 					reply["returncode"] = 0;
 				} else {
@@ -281,6 +471,8 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 				Variant::Map::iterator it = variables.find(content["variable"].asString());
 				if (it != variables.end()) {
 					variables.erase(it);
+					sectionChanged(variablesSequence);
+					emitVariableEvent("event.system.variabledeleted", content["variable"].asString(), Variant());
 					if (variantMapToJSONFile(variables, VARIABLESMAPFILE)) {
 						reply["returncode"] = 0;
 					} else {
@@ -305,72 +497,131 @@ qpid::types::Variant::Map commandHandler(qpid::types::Variant::Map content) {
 	} else {
 		if (content["command"] == "inventory") {
 			// cout << "responding to inventory request" << std::endl;
-			for (qpid::types::Variant::Map::iterator it = inventory.begin(); it != inventory.end(); it++) {
-				if (!it->second.isVoid()) {
-					qpid::types::Variant::Map *device = &it->second.asMap();
-					if (time(NULL) - (*device)["lastseen"].asUint64() > 2*discoverdelay) {
-						// cout << "Stale device: " << it->first << endl;
-						(*device)["stale"] = 1;
-						saveDevicemap();
-					}
+			markStaleDevices();
+			fillInventory(reply, content["schemaversion"].asString());
+			reply["returncode"] = 0;
+		} else if (content["command"] == "getinventorydelta") {
+			// answer with the devices and sections changed after the given sequence. a full
+			// inventory is sent when the client has no usable base: no sequence, a sequence
+			// of another resolver run, or one older than the oldest remembered removal.
+			uint64_t since = 0;
+			if (!content["since"].isVoid()) since = content["since"].asUint64();
+			markStaleDevices();
+			if (since == 0 || since < tombstoneHorizon || since > inventorySequence || content["epoch"].asString() != inventoryEpoch) {
+				fillInventory(reply, content["schemaversion"].asString());
+				reply["full"] = true;
+			} else {
+				Variant::Map devices;
+				Variant::List removed;
+				// clients apply removed before devices, a device may have been removed and announced again
+				for (std::map<uint64_t, std::string>::iterator it = deviceRemovals.upper_bound(since); it != deviceRemovals.end(); it++) {
+					removed.push_back(it->second);
 				}
+				for (std::map<uint64_t, std::string>::iterator it = deviceChanges.upper_bound(since); it != deviceChanges.end(); it++) {
+					devices[it->second] = inventory[it->second];
+				}
+				reply["devices"] = devices;
+				reply["removed"] = removed;
+				if (roomsSequence > since) reply["rooms"] = inv->getrooms();
+				if (floorplansSequence > since) reply["floorplans"] = inv->getfloorplans();
+				if (variablesSequence > since) reply["variables"] = variables;
+				if (environmentSequence > since) reply["environment"] = environment;
+				reply["full"] = false;
+				reply["sequence"] = inventorySequence;
+				reply["epoch"] = inventoryEpoch;
+				reply["schemaversion"] = schemaVersion;
 			}
-			reply["devices"] = inventory;
-			reply["schema"] = schema;	
-			reply["rooms"] = inv->getrooms();
-			reply["floorplans"] = inv->getfloorplans();
-			get_sysinfo();
-			reply["system"] = systeminfo;
-			reply["variables"] = variables;
-			reply["environment"] = environment;
 			reply["returncode"] = 0;
+		} else if (content["command"] == "getschema") {
+			// the schema only changes with a resolver restart, send it when the client's copy is outdated
+			if (content["schemaversion"].asString() != schemaVersion) reply["schema"] = schema;
+			reply["schemaversion"] = schemaVersion;
+			reply["returncode"] = 0;
+		} else if (content["command"] == "validatecommand") {
+			// check the command in "request" against the schema of the addressed device's type
+			std::string error;
+			bool valid = false;
+			if (content["request"].getType() == VAR_MAP) {
+				const Variant::Map &request = content["request"].asMap();
+				std::string devicetype = content["devicetype"].asString();
+				if (devicetype == "") {
+					Variant::Map::const_iterator uuid = request.find("uuid");
+					Variant::Map::const_iterator device = uuid != request.end() ? inventory.find(uuid->second.asString()) : inventory.end();
+					if (device != inventory.end() && device->second.getType() == VAR_MAP) {
+						Variant::Map::const_iterator type = device->second.asMap().find("devicetype");
+						if (type != device->second.asMap().end()) devicetype = type->second.asString();
+					}
+				}
+				if (devicetype != "") {
+					valid = schemaIndex.validateCommand(devicetype, request, error);
+				} else {
+					error = "unknown device";
+				}
+			} else {
+				error = "no request given";
+			}
+			reply["valid"] = valid;
+			if (!valid) reply["error"] = error;
+			reply["returncode"] = valid ? 0 : -1;
 		}
 	}
 	return reply;
 }
 
+// add or refresh a device from an announce, caller holds inventoryMutex
+void announceDevice(const string &uuid, const string &devicetype, const string &internalid, const string &handledby, uint64_t timestamp) {
+	Variant::Map device;
+	Variant::Map values;
+	device["devicetype"]=devicetype;
+	device["internalid"]=internalid;
+	device["handled-by"]=handledby;
+	device["name"]=inv->getdevicename(uuid);
+	if (device["name"].asString() == "" && devicetype == "agocontroller") device["name"]="agocontroller";
+	device["name"].setEncoding("utf8");
+	device["room"]=inv->getdeviceroom(uuid); 
+	device["room"].setEncoding("utf8");
+	device["lastseen"] = timestamp;
+	device["stale"] = 0;
+	qpid::types::Variant::Map::const_iterator it = inventory.find(uuid);
+	if (it == inventory.end()) {
+		// device is newly announced, set default state and values
+		device["state"]="0";
+		device["state"].setEncoding("utf8");
+		device["values"]=values;
+		cout << "adding device: uuid="  << uuid  << " type: " << devicetype << std::endl;
+	} else {
+		// device exists, get current values
+		// TODO: use a non-const interator and modify the timestamp in place to avoid the following copying of data
+		qpid::types::Variant::Map olddevice;
+		if (!it->second.isVoid())  {
+			olddevice= it->second.asMap();
+			device["state"] = olddevice["state"];
+			device["values"] = olddevice["values"];
+		}
+	}
+	inventory[uuid] = device;
+	deviceChanged(uuid);
+	saveDevicemap();
+}
+
 void eventHandler(std::string subject, qpid::types::Variant::Map content) {
+	InventoryLock lock;
 	if (subject == "event.device.announce") {
 		string uuid = content["uuid"];
 		if (uuid != "") {
-			// clog << agocontrol::kLogDebug << "preparing device: uuid="  << uuid << std::endl;
-			Variant::Map device;
-			Variant::Map values;
-			device["devicetype"]=content["devicetype"].asString();
-			device["internalid"]=content["internalid"].asString();
-			device["handled-by"]=content["handled-by"].asString();
-			// clog << agocontrol::kLogDebug << "getting name from inventory" << endl;
-			device["name"]=inv->getdevicename(content["uuid"].asString());
-			if (device["name"].asString() == "" && device["devicetype"] == "agocontroller") device["name"]="agocontroller";
-			device["name"].setEncoding("utf8");
-			// clog << agocontrol::kLogDebug << "getting room from inventory" << endl;
-			device["room"]=inv->getdeviceroom(content["uuid"].asString()); 
-			device["room"].setEncoding("utf8");
-			uint64_t timestamp;
-			timestamp = time(NULL);
-			device["lastseen"] = timestamp;
-			device["stale"] = 0;
-			qpid::types::Variant::Map::const_iterator it = inventory.find(uuid);
-			if (it == inventory.end()) {
-				// device is newly announced, set default state and values
-				device["state"]="0";
-				device["state"].setEncoding("utf8");
-				device["values"]=values;
-				cout << "adding device: uuid="  << uuid  << " type: " << device["devicetype"].asString() << std::endl;
-			} else {
-				// device exists, get current values
-				// TODO: use a non-const interator and modify the timestamp in place to avoid the following copying of data
-				qpid::types::Variant::Map olddevice;
-				if (!it->second.isVoid())  {
-					olddevice= it->second.asMap();
-					device["state"] = olddevice["state"];
-					device["values"] = olddevice["values"];
-				}
+			announceDevice(uuid, content["devicetype"].asString(), content["internalid"].asString(), content["handled-by"].asString(), time(NULL));
+		}
+	} else if (subject == "event.device.announcelist") {
+		// a driver's answer to discover, all of its devices in one message
+		string handledby = content["handled-by"].asString();
+		uint64_t timestamp = time(NULL);
+		if (content["devices"].getType() == VAR_MAP) {
+			Variant::Map &devices = content["devices"].asMap();
+			for (Variant::Map::iterator it = devices.begin(); it != devices.end(); it++) {
+				if (it->first == "" || it->second.getType() != VAR_MAP) continue;
+				Variant::Map &device = it->second.asMap();
+				announceDevice(it->first, device["devicetype"].asString(), device["internalid"].asString(), handledby, timestamp);
 			}
-				
-			// clog << agocontrol::kLogDebug << "adding device: uuid="  << uuid  << " type: " << device["devicetype"].asString() << std::endl;
-			inventory[uuid] = device;
-			saveDevicemap();
 		}
 	} else if (subject == "event.device.remove") {
 		string uuid = content["uuid"];
@@ -379,6 +630,7 @@ void eventHandler(std::string subject, qpid::types::Variant::Map content) {
 			Variant::Map::iterator it = inventory.find(uuid);
 			if (it != inventory.end()) {
 				inventory.erase(it);
+				deviceRemoved(uuid);
 				saveDevicemap();
 			}
 		}
@@ -388,29 +640,81 @@ void eventHandler(std::string subject, qpid::types::Variant::Map content) {
 		variables["weekday"] = content["weekday"].asString();
 		variables["minute"] = content["minute"].asString();
 		variables["month"] = content["month"].asString();
+		sectionChanged(variablesSequence);
 	} else {
 		if (subject == "event.environment.positionchanged") {
 			environment["latitude"] = content["latitude"];
 			environment["longitude"] = content["longitude"];
+			sectionChanged(environmentSequence);
 		}
 		if (content["uuid"].asString() != "") {
 			string uuid = content["uuid"];
 			// see if we have that device in the inventory already, if yes handle the event
 			if (inventory.find(uuid) != inventory.end()) {
-				if (!inventory[uuid].isVoid()) handleEvent(&inventory[uuid].asMap(), subject, &content);
+				if (!inventory[uuid].isVoid()) handleEvent(uuid, &inventory[uuid].asMap(), subject, &content);
 			}
 		}
 
 	}
 }
 
-void *discover(void *param) {
+void sendDiscover(const Variant::List &targets) {
 	Variant::Map discovercmd;
 	discovercmd["command"] = "discover";
+	discovercmd["jitter"] = discoverjitter * 1000;
+	if (targets.size() > 0) discovercmd["targets"] = targets;
+	agoConnection->sendMessage("",discovercmd);
+}
+
+// drivers whose oldest device announce is older than discoverdelay and that were not asked
+// within the last discoverdelay seconds, longest silent first, at most discovertargets
+Variant::List dueDrivers() {
+	std::map<std::string, uint64_t> oldest; // handled-by -> oldest lastseen of its devices
+	{
+		InventoryLock lock;
+		for (Variant::Map::const_iterator it = inventory.begin(); it != inventory.end(); it++) {
+			if (it->second.getType() != VAR_MAP) continue;
+			const Variant::Map &device = it->second.asMap();
+			Variant::Map::const_iterator handledby = device.find("handled-by");
+			Variant::Map::const_iterator lastseen = device.find("lastseen");
+			if (handledby == device.end() || lastseen == device.end() || handledby->second.asString() == "") continue;
+			std::map<std::string, uint64_t>::iterator driver = oldest.find(handledby->second.asString());
+			if (driver == oldest.end()) {
+				oldest[handledby->second.asString()] = lastseen->second.asUint64();
+			} else if (lastseen->second.asUint64() < driver->second) {
+				driver->second = lastseen->second.asUint64();
+			}
+		}
+	}
+
+	time_t now = time(NULL);
+	std::multimap<uint64_t, std::string> due;
+	for (std::map<std::string, uint64_t>::const_iterator it = oldest.begin(); it != oldest.end(); it++) {
+		if (now - it->second < discoverdelay) continue;
+		std::map<std::string, time_t>::const_iterator requested = discoverRequested.find(it->first);
+		if (requested != discoverRequested.end() && now - requested->second < discoverdelay) continue;
+		due.insert(std::make_pair(it->second, it->first));
+	}
+
+	Variant::List targets;
+	for (std::multimap<uint64_t, std::string>::const_iterator it = due.begin(); it != due.end() && targets.size() < discovertargets; it++) {
+		targets.push_back(it->second);
+		discoverRequested[it->second] = now;
+	}
+	return targets;
+}
+
+void *discover(void *param) {
 	sleep(2);
+	// everybody answers the first round, later rounds only go to the drivers that are due
+	sendDiscover(Variant::List());
 	while (true) {
-		agoConnection->sendMessage("",discovercmd);
-		sleep(discoverdelay);
+		sleep(discoverinterval);
+		Variant::List targets = dueDrivers();
+		if (targets.size() > 0) {
+			clog << agocontrol::kLogDebug << "discovering devices of " << targets.size() << " drivers" << std::endl;
+			sendDiscover(targets);
+		}
 	}
 	return NULL;
 }
@@ -418,6 +722,17 @@ void *discover(void *param) {
 int main(int argc, char **argv) {
 //	clog.rdbuf(new agocontrol::Log("agoresolver", LOG_LOCAL0));
 
+	// block the termination signals in all threads, they are handled by shutdownHandler
+	static sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGINT);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+
+	pthread_mutex_init(&inventoryMutex, NULL);
+	pthread_mutex_init(&persistMutex, NULL);
+	pthread_cond_init(&persistCond, NULL);
+
 	agoConnection = new AgoConnection("resolver");
 	agoConnection->addHandler(commandHandler);
 	agoConnection->addEventHandler(eventHandler);
@@ -429,7 +744,17 @@ int main(int argc, char **argv) {
 
 	schemaPrefix=getConfigOption("system", "schemapath", CONFDIR "/schema.d/");
 	discoverdelay=atoi(getConfigOption("system", "discoverdelay", "300").c_str());
-	if (atoi(getConfigOption("system","devicepersistence", "0").c_str()) != 1) persistence=false;
+	if (discoverdelay < 1) discoverdelay = 1;
+	discoverinterval = atoi(getConfigOption("system", "discoverinterval", "0").c_str());
+	if (discoverinterval < 1) discoverinterval = discoverdelay / 10 > 0 ? discoverdelay / 10 : 1;
+	discoverjitter = atoi(getConfigOption("system", "discoverjitter", "10").c_str());
+	discovertargets = atoi(getConfigOption("system", "discovertargets", "10").c_str());
+	if (discovertargets < 1) discovertargets = 1;
+	persistence = atoi(getConfigOption("system","devicepersistence", "0").c_str()) == 1;
+	persistInterval = atoi(getConfigOption("system", "persistinterval", "30").c_str());
+	persistThreshold = atoi(getConfigOption("system", "persistthreshold", "500").c_str());
+	if (persistInterval < 1) persistInterval = 1;
+	if (persistThreshold < 1) persistThreshold = 1;
 
 	systeminfo["uuid"] = getConfigOption("system", "uuid", "00000000-0000-0000-000000000000");
 	systeminfo["version"] = AGOCONTROL_VERSION;
@@ -454,25 +779,27 @@ int main(int argc, char **argv) {
 
 	// load schema files in proper order
 	std::sort(schemaArray.begin(), schemaArray.end());
-	std::string schemaFile = schemaPrefix + schemaArray.front();
-	schema = parseSchema(schemaFile.c_str());
-	clog << agocontrol::kLogDebug << "parsing schema file:" << schemaFile << std::endl;
-	for (int i=1; i < schemaArray.size(); i++) {
-		schemaFile = schemaPrefix + schemaArray[i];
-		clog << agocontrol::kLogDebug << "parsing additional schema file:" << schemaFile << std::endl;
-		schema = mergeMap(schema, parseSchema(schemaFile.c_str()));
-	}
+	schema = loadSchema(schemaPrefix, schemaArray, SCHEMASNAPSHOTFILE);
+	schemaIndex.build(schema);
+	schemaVersion = hashSchema(schema);
 
 	clog << agocontrol::kLogDebug << "reading inventory" << std::endl;
 	inv = new Inventory(CONFDIR "/db/inventory.db");
 
 	variables = jsonFileToVariantMap(VARIABLESMAPFILE);
 	if (persistence) loadDevicemap();
+	inventoryEpoch = generateUuid();
+	for (Variant::Map::const_iterator it = inventory.begin(); it != inventory.end(); it++) deviceChanged(it->first);
 
 	agoConnection->addDevice("agocontroller","agocontroller");
 
 	static pthread_t discoverThread;
 	pthread_create(&discoverThread,NULL,discover,NULL);
+
+	static pthread_t persistThread;
+	static pthread_t shutdownThread;
+	if (persistence) pthread_create(&persistThread,NULL,persistDevicemap,NULL);
+	pthread_create(&shutdownThread,NULL,shutdownHandler,&signals);
 	
 	// discover devices
 	clog << agocontrol::kLogDebug << "discovering devices" << std::endl;
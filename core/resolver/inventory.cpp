@@ -10,6 +10,11 @@
 
 using namespace std;
 
+static string columntext(sqlite3_stmt *stmt, int column) {
+	const char *text = (const char*)sqlite3_column_text(stmt, column);
+	return text != NULL ? string(text) : string();
+}
+
 bool Inventory::createTableIfNotExist(std::string tablename, std::string createquery) {
 	string query = "SELECT name FROM sqlite_master WHERE type='table' AND name = ?";
 	if (getfirst(query.c_str(), 1, tablename.c_str()) != tablename) {
@@ -42,145 +47,130 @@ Inventory::Inventory(const char *dbfile) {
 	createTableIfNotExist("devicesfloorplan", "CREATE TABLE devicesfloorplan (floorplan text, device text, x integer, y integer)");
 	createTableIfNotExist("locations", "CREATE TABLE locations (uuid text, name text, description text)");
 	createTableIfNotExist("users", "CREATE TABLE users (uuid text, username text, password text, pin text, description text)");
+	loadMirror();
 }
 
-string Inventory::getdevicename (string uuid) {
-	string query = "select name from devices where uuid = ?";
-	return getfirst(query.c_str(), 1, uuid.c_str());
+Inventory::~Inventory() {
+	for (std::map<std::string, sqlite3_stmt *>::iterator it = statements.begin(); it != statements.end(); it++) {
+		sqlite3_finalize(it->second);
+	}
+	statements.clear();
+	sqlite3_close(db);
 }
 
-string Inventory::getdeviceroom (string uuid) {
-	string query = "select room from devices where uuid = ?";
-	return getfirst(query.c_str(), 1, uuid.c_str());
-}
+void Inventory::loadMirror() {
+	sqlite3_stmt *stmt;
 
-int Inventory::setdevicename (string uuid, string name) {
-	if (name == "") {
-		string query = "delete from devices where uuid = ?";
-		getfirst(query.c_str(), 1, uuid.c_str());
-		return 0;
+	// on duplicate rows the first one wins, like getfirst() did
+	if ((stmt = prepare("select uuid, name, room from devices")) != NULL) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			if (sqlite3_column_type(stmt, 0) != SQLITE_TEXT) continue;
+			string uuid = columntext(stmt, 0);
+			if (devices.find(uuid) != devices.end()) continue;
+			DeviceRecord &device = devices[uuid];
+			device.name = columntext(stmt, 1);
+			device.room = columntext(stmt, 2);
+		}
+		sqlite3_reset(stmt);
 	}
-        if (getdevicename(uuid) == "") { // does not exist, create
-                string query = "insert into devices (name, uuid) VALUES (?, ?)";
-                printf("creating device: %s\n", query.c_str());
-                getfirst(query.c_str(), 2, name.c_str(), uuid.c_str());
-        } else {
-                string query = "update devices set name = ? where uuid = ?";
-                getfirst(query.c_str(), 2, name.c_str(), uuid.c_str());
-        }
-        if (getdevicename(uuid) == name) {
-                return 0;
-        } else {
-                return -1;
-        }
-} 
-
-string Inventory::getroomname (string uuid) {
-	string query = "select name from rooms where uuid = ?";
-	return getfirst(query.c_str(), 1, uuid.c_str());
-}
-
-int Inventory::setroomname (string uuid, string name) { 
-	if (getroomname(uuid) == "") { // does not exist, create
-		string query = "insert into rooms (name, uuid) VALUES (?, ?)";
-		printf("creating room: %s\n", query.c_str());
-		getfirst(query.c_str(), 2, name.c_str(), uuid.c_str());
-	} else {
-		string query = "update rooms set name = ? where uuid = ?";
-		getfirst(query.c_str(), 2, name.c_str(), uuid.c_str());
+	if ((stmt = prepare("select uuid, name, location from rooms")) != NULL) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			if (sqlite3_column_type(stmt, 0) != SQLITE_TEXT) continue;
+			string uuid = columntext(stmt, 0);
+			if (rooms.find(uuid) != rooms.end()) continue;
+			RoomRecord &room = rooms[uuid];
+			room.name = columntext(stmt, 1);
+			room.location = columntext(stmt, 2);
+		}
+		sqlite3_reset(stmt);
 	}
-	if (getroomname(uuid) == name) {
-		return 0;
-	} else {
-		return -1;
+	if ((stmt = prepare("select uuid, name from floorplans")) != NULL) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			if (sqlite3_column_type(stmt, 0) != SQLITE_TEXT) continue;
+			string uuid = columntext(stmt, 0);
+			if (floorplans.find(uuid) != floorplans.end()) continue;
+			floorplans[uuid] = columntext(stmt, 1);
+		}
+		sqlite3_reset(stmt);
 	}
-} 
-
-int Inventory::setdeviceroom (string deviceuuid, string roomuuid) {
-	string query = "update devices set room = ? where uuid = ?";
-	getfirst(query.c_str(), 2, roomuuid.c_str(), deviceuuid.c_str());
-	if (getdeviceroom(deviceuuid) == roomuuid) {
-		return 0;
-	} else {
-		return -1;
+	if ((stmt = prepare("select floorplan, device, x, y from devicesfloorplan")) != NULL) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			std::map<string, FloorplanPosition> &positions = floorplanDevices[columntext(stmt, 0)];
+			string device = columntext(stmt, 1);
+			if (positions.find(device) != positions.end()) continue;
+			FloorplanPosition &position = positions[device];
+			position.x = sqlite3_column_int(stmt, 2);
+			position.y = sqlite3_column_int(stmt, 3);
+		}
+		sqlite3_reset(stmt);
 	}
-} 
+}
 
-string Inventory::getdeviceroomname (string uuid) {
-	string query = "select room from devices where uuid = ?";
-	return getroomname(getfirst(query.c_str(), 1, uuid.c_str()));
-} 
+sqlite3_stmt *Inventory::prepare(const char *query) {
+	std::map<std::string, sqlite3_stmt *>::iterator it = statements.find(query);
+	if (it != statements.end()) return it->second;
 
-Variant::Map Inventory::getrooms() {
-	Variant::Map result;
 	sqlite3_stmt *stmt;
-	int rc;
-
-	rc = sqlite3_prepare_v2(db, "select uuid, name, location from rooms", -1, &stmt, NULL);
+	int rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
 	if(rc!=SQLITE_OK) {
-                fprintf(stderr, "sql error #%d: %s\n", rc,sqlite3_errmsg(db));
-                return result;
-        }
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
-		Variant::Map entry;
-		const char *roomname = (const char*)sqlite3_column_text(stmt, 1);
-		const char *location = (const char*)sqlite3_column_text(stmt, 2);
-		const char *uuid = (const char*)sqlite3_column_text(stmt, 0);
-		if (roomname != NULL) {
-			entry["name"] = string(roomname);
-		} else {
-			entry["name"] = "";
-		} 
-		if (location != NULL) {
-			entry["location"] = string(location);
-		} else {	
-			entry["location"] = "";
-		}
-		if (uuid != NULL) {
-			result[uuid] = entry;
-		}
+		fprintf(stderr, "sql error #%d: %s\n", rc,sqlite3_errmsg(db));
+		return NULL;
 	}
+	statements[query] = stmt;
+	return stmt;
+}
 
-	sqlite3_finalize (stmt);
+bool Inventory::begin() {
+	return execute("BEGIN", 0);
+}
 
-	return result;
-} 
-int Inventory::deleteroom (string uuid) {
-	getfirst("BEGIN");
-	string query = "update devices set room = '' where room = ?";
-	getfirst(query.c_str(), 1, uuid.c_str());
-	query = "delete from rooms where uuid = ?";
-	getfirst(query.c_str(), 1, uuid.c_str());
-	if (getroomname(uuid) != "") {
-		getfirst("ROLLBACK");
-		return -1;
-	} else {
-		getfirst("COMMIT");
-		return 0;
+bool Inventory::finish(bool ok) {
+	if (ok && execute("COMMIT", 0)) return true;
+	execute("ROLLBACK", 0);
+	return false;
+}
+
+bool Inventory::execute(const char *query, int n, ...) {
+	sqlite3_stmt *stmt;
+	int rc, i;
+	va_list args;
+
+	if ((stmt = prepare(query)) == NULL) return false;
+
+	// bound text is only borrowed, bindings are cleared before returning
+	va_start(args, n);
+	for(i = 0; i < n; i++) {
+		sqlite3_bind_text(stmt, i + 1, va_arg(args, char*), -1, SQLITE_STATIC);
+	}
+	va_end(args);
+
+	rc = sqlite3_step(stmt);
+	if (rc != SQLITE_DONE && rc != SQLITE_ROW) {
+		fprintf(stderr, "step error: %s\n",sqlite3_errmsg(db));
 	}
-	getfirst("ROLLBACK");
-	return -1;
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return rc == SQLITE_DONE || rc == SQLITE_ROW;
 }
+
 string Inventory::getfirst(const char *query) {
-    return getfirst(query, 0);
+	return getfirst(query, 0);
 }
+
 string Inventory::getfirst(const char *query, int n, ...) {
 	sqlite3_stmt *stmt;
 	int rc, i;
 	string result;
-    va_list args;
+	va_list args;
 
-	rc = sqlite3_prepare_v2(db, query, -1, &stmt, NULL);
-	if(rc!=SQLITE_OK) {
-		fprintf(stderr, "sql error #%d: %s\n", rc,sqlite3_errmsg(db));
-		return result;
-	}
+	if ((stmt = prepare(query)) == NULL) return result;
 
-    va_start(args, n);
-    
-    for(i = 0; i < n; i++) {
-        sqlite3_bind_text(stmt, i + 1, va_arg(args, char*), -1, NULL);
-    }
+	va_start(args, n);
+	for(i = 0; i < n; i++) {
+		sqlite3_bind_text(stmt, i + 1, va_arg(args, char*), -1, SQLITE_STATIC);
+	}
+	va_end(args);
 
 	rc = sqlite3_step(stmt);
 	switch(rc) {
@@ -191,120 +181,175 @@ string Inventory::getfirst(const char *query, int n, ...) {
 			if (sqlite3_column_type(stmt, 0) == SQLITE_TEXT) result =string( (const char*)sqlite3_column_text(stmt, 0));
 			break;
 	}
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	return result;
+}
+
+string Inventory::getdevicename (string uuid) {
+	std::map<string, DeviceRecord>::const_iterator it = devices.find(uuid);
+	return it != devices.end() ? it->second.name : string();
+}
+
+string Inventory::getdeviceroom (string uuid) {
+	std::map<string, DeviceRecord>::const_iterator it = devices.find(uuid);
+	return it != devices.end() ? it->second.room : string();
+}
+
+int Inventory::setdevicename (string uuid, string name) {
+	if (name == "") {
+		if (!execute("delete from devices where uuid = ?", 1, uuid.c_str())) return -1;
+		devices.erase(uuid);
+		return 0;
+	}
+	std::map<string, DeviceRecord>::iterator it = devices.find(uuid);
+	if (it == devices.end()) { // does not exist, create
+		string query = "insert into devices (name, uuid) VALUES (?, ?)";
+		printf("creating device: %s\n", query.c_str());
+		if (!execute(query.c_str(), 2, name.c_str(), uuid.c_str())) return -1;
+		devices[uuid].name = name;
+	} else if (it->second.name != name) {
+		if (!execute("update devices set name = ? where uuid = ?", 2, name.c_str(), uuid.c_str())) return -1;
+		it->second.name = name;
+	}
+	return 0;
+} 
 
-    va_end(args);
-	sqlite3_finalize(stmt);
+string Inventory::getroomname (string uuid) {
+	std::map<string, RoomRecord>::const_iterator it = rooms.find(uuid);
+	return it != rooms.end() ? it->second.name : string();
+}
 
+int Inventory::setroomname (string uuid, string name) { 
+	std::map<string, RoomRecord>::iterator it = rooms.find(uuid);
+	if (it == rooms.end()) { // does not exist, create
+		string query = "insert into rooms (name, uuid) VALUES (?, ?)";
+		printf("creating room: %s\n", query.c_str());
+		if (!execute(query.c_str(), 2, name.c_str(), uuid.c_str())) return -1;
+		rooms[uuid].name = name;
+	} else if (it->second.name != name) {
+		if (!execute("update rooms set name = ? where uuid = ?", 2, name.c_str(), uuid.c_str())) return -1;
+		it->second.name = name;
+	}
+	return 0;
+} 
+
+int Inventory::setdeviceroom (string deviceuuid, string roomuuid) {
+	std::map<string, DeviceRecord>::iterator it = devices.find(deviceuuid);
+	if (it == devices.end()) {
+		// nothing to update, an unknown device has no room
+		return roomuuid == "" ? 0 : -1;
+	}
+	if (it->second.room == roomuuid) return 0;
+	if (!execute("update devices set room = ? where uuid = ?", 2, roomuuid.c_str(), deviceuuid.c_str())) return -1;
+	it->second.room = roomuuid;
+	return 0;
+} 
+
+string Inventory::getdeviceroomname (string uuid) {
+	return getroomname(getdeviceroom(uuid));
+} 
+
+Variant::Map Inventory::getrooms() {
+	Variant::Map result;
+	for (std::map<string, RoomRecord>::const_iterator it = rooms.begin(); it != rooms.end(); it++) {
+		Variant::Map entry;
+		entry["name"] = it->second.name;
+		entry["location"] = it->second.location;
+		result[it->first] = entry;
+	}
 	return result;
+} 
+int Inventory::deleteroom (string uuid) {
+	if (!begin()) return -1;
+	bool ok = execute("update devices set room = '' where room = ?", 1, uuid.c_str())
+		&& execute("delete from rooms where uuid = ?", 1, uuid.c_str());
+	if (!finish(ok)) return -1;
+
+	for (std::map<string, DeviceRecord>::iterator it = devices.begin(); it != devices.end(); it++) {
+		if (it->second.room == uuid) it->second.room = "";
+	}
+	rooms.erase(uuid);
+	return 0;
 }
 
 string Inventory::getfloorplanname(std::string uuid) {
-	string query = "select name from floorplans where uuid = ?";
-	return getfirst(query.c_str(), 1, uuid.c_str());
+	std::map<string, string>::const_iterator it = floorplans.find(uuid);
+	return it != floorplans.end() ? it->second : string();
 }
 
 int Inventory::setfloorplanname(std::string uuid, std::string name) {
-	if (getfloorplanname(uuid) == "") { // does not exist, create
+	std::map<string, string>::iterator it = floorplans.find(uuid);
+	if (it == floorplans.end()) { // does not exist, create
 		string query = "insert into floorplans (name, uuid) VALUES (?, ?)";
 		printf("creating floorplan: %s\n", query.c_str());
-		getfirst(query.c_str(), 2, name.c_str(), uuid.c_str());
-	} else {
-		string query = "update floorplans set name = ? where uuid = ?";
-		getfirst(query.c_str(), 2, name.c_str(), uuid.c_str());
-	}
-	if (getfloorplanname(uuid) == name) {
-		return 0;
-	} else {
-		return -1;
+		if (!execute(query.c_str(), 2, name.c_str(), uuid.c_str())) return -1;
+		floorplans[uuid] = name;
+	} else if (it->second != name) {
+		if (!execute("update floorplans set name = ? where uuid = ?", 2, name.c_str(), uuid.c_str())) return -1;
+		it->second = name;
 	}
+	return 0;
 }
 
 int Inventory::setdevicefloorplan(std::string deviceuuid, std::string floorplanuuid, int x, int y) {
 	stringstream xstr, ystr;
 	xstr << x;
 	ystr << y;
-	string query = "select floorplan from devicesfloorplan where floorplan = ? and device = ?";
-	if (getfirst(query.c_str(), 2, floorplanuuid.c_str(), deviceuuid.c_str())==floorplanuuid) {
+	std::map<string, FloorplanPosition> &positions = floorplanDevices[floorplanuuid];
+	std::map<string, FloorplanPosition>::iterator it = positions.find(deviceuuid);
+	bool ok;
+	if (it != positions.end()) {
 		// already exists, update
-        query = "update devicesfloorplan set x=?, y=? where floorplan = ? and device = ?";
-		getfirst(query.c_str(), 4, xstr.str().c_str(), ystr.str().c_str(), floorplanuuid.c_str(), deviceuuid.c_str());
-
+		if (it->second.x == x && it->second.y == y) return 0;
+		string query = "update devicesfloorplan set x=?, y=? where floorplan = ? and device = ?";
+		ok = execute(query.c_str(), 4, xstr.str().c_str(), ystr.str().c_str(), floorplanuuid.c_str(), deviceuuid.c_str());
 	} else {
 		// create new record
-		query = "insert into devicesfloorplan (x, y, floorplan, device) VALUES (?, ?, ?, ?)";
+		string query = "insert into devicesfloorplan (x, y, floorplan, device) VALUES (?, ?, ?, ?)";
 		cout << query << endl;
-		getfirst(query.c_str(), 4, xstr.str().c_str(), ystr.str().c_str(), floorplanuuid.c_str(), deviceuuid.c_str());
+		ok = execute(query.c_str(), 4, xstr.str().c_str(), ystr.str().c_str(), floorplanuuid.c_str(), deviceuuid.c_str());
 	}
-
+	if (!ok) {
+		if (positions.empty()) floorplanDevices.erase(floorplanuuid);
+		return -1;
+	}
+	FloorplanPosition &position = positions[deviceuuid];
+	position.x = x;
+	position.y = y;
 	return 0;
 }
 
 int Inventory::deletefloorplan(std::string uuid) {
-	getfirst("BEGIN");
-	string query = "delete from devicesfloorplan where floorplan = ?";
-	getfirst(query.c_str(), 1, uuid.c_str());
-	query = "delete from floorplans where uuid = ?";
-	getfirst(query.c_str(), 1, uuid.c_str());
-	if (getfloorplanname(uuid) != "") {
-	    getfirst("ROLLBACK");
-		return -1;
-	} else {
-	    getfirst("COMMIT");
-		return 0;
-	}
-	getfirst("ROLLBACK");
-	return -1;
+	if (!begin()) return -1;
+	bool ok = execute("delete from devicesfloorplan where floorplan = ?", 1, uuid.c_str())
+		&& execute("delete from floorplans where uuid = ?", 1, uuid.c_str());
+	if (!finish(ok)) return -1;
+
+	floorplanDevices.erase(uuid);
+	floorplans.erase(uuid);
+	return 0;
 }
 
 Variant::Map Inventory::getfloorplans() {
 	Variant::Map result;
-	sqlite3_stmt *stmt;
-	int rc;
-
-	rc = sqlite3_prepare_v2(db, "select uuid, name from floorplans", -1, &stmt, NULL);
-	if(rc!=SQLITE_OK) {
-                fprintf(stderr, "sql error #%d: %s\n", rc,sqlite3_errmsg(db));
-                return result;
-        }
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
+	for (std::map<string, string>::const_iterator it = floorplans.begin(); it != floorplans.end(); it++) {
 		Variant::Map entry;
-		const char *floorplanname = (const char*)sqlite3_column_text(stmt, 1);
-		const char *uuid = (const char*)sqlite3_column_text(stmt, 0);
-		if (floorplanname != NULL) {
-			entry["name"] = string(floorplanname);
-		} else {
-			entry["name"] = "";
-		} 
-
-		// for each floorplan now fetch the device coordinates
-		sqlite3_stmt *stmt2;
-		int rc2;
-		string query = "select device, x, y from devicesfloorplan where floorplan = ?";
-		rc2 = sqlite3_prepare_v2(db, query.c_str(), -1, &stmt2, NULL);
-		if (rc2 != SQLITE_OK) {
-			fprintf(stderr, "sql error #%d: %s\n", rc2,sqlite3_errmsg(db));
-			continue;
-		}
-		sqlite3_bind_text(stmt2, 1, uuid, -1, NULL);
-		while (sqlite3_step(stmt2) == SQLITE_ROW) {
-			Variant::Map device;
-			const char *deviceuuid = (const char*)sqlite3_column_text(stmt2, 0);
-			const char *x = (const char*)sqlite3_column_text(stmt2, 1);
-			const char *y = (const char*)sqlite3_column_text(stmt2, 2);
-			device["x"] = atoi(x);
-			device["y"] = atoi(y);
-			entry[deviceuuid] = device;
-		}
-
-		sqlite3_finalize (stmt2);			
-
-		if (uuid != NULL) {
-			result[uuid] = entry;
+		entry["name"] = it->second;
+
+		// device coordinates are stored next to the name, keyed by device uuid
+		std::map<string, std::map<string, FloorplanPosition> >::const_iterator positions = floorplanDevices.find(it->first);
+		if (positions != floorplanDevices.end()) {
+			for (std::map<string, FloorplanPosition>::const_iterator pos = positions->second.begin(); pos != positions->second.end(); pos++) {
+				Variant::Map device;
+				device["x"] = pos->second.x;
+				device["y"] = pos->second.y;
+				entry[pos->first] = device;
+			}
 		}
+		result[it->first] = entry;
 	}
-
-	sqlite3_finalize (stmt);
-
 	return result;
 } 
 
@@ -314,69 +359,57 @@ string Inventory::getlocationname (string uuid) {
 }
 
 string Inventory::getroomlocation(string uuid) {
-	string query = "select location from rooms where uuid = ?";
-	return getfirst(query.c_str(), 1, uuid.c_str());
+	std::map<string, RoomRecord>::const_iterator it = rooms.find(uuid);
+	return it != rooms.end() ? it->second.location : string();
 }
 
 int Inventory::setlocationname(string uuid, string name) {
-        if (getlocationname(uuid) == "") { // does not exist, create
-                string query = "insert into locations (name, uuid) VALUES (?, ?)";
-                printf("creating location: %s\n", query.c_str());
-                getfirst(query.c_str(), 2, name.c_str(), uuid.c_str());
-        } else {
-                string query = "update locations set name = ? where uuid = ?";
-                getfirst(query.c_str(), 2, name.c_str(), uuid.c_str());
-        }
-        if (getlocationname(uuid) == name) {
-                return 0;
-        } else {
-                return -1;
-        }
-
+	bool ok;
+	if (getlocationname(uuid) == "") { // does not exist, create
+		string query = "insert into locations (name, uuid) VALUES (?, ?)";
+		printf("creating location: %s\n", query.c_str());
+		ok = execute(query.c_str(), 2, name.c_str(), uuid.c_str());
+	} else {
+		string query = "update locations set name = ? where uuid = ?";
+		ok = execute(query.c_str(), 2, name.c_str(), uuid.c_str());
+	}
+	return ok ? 0 : -1;
 }
 int Inventory::setroomlocation(string roomuuid, string locationuuid) {
-	string query = "update rooms set location = ? where uuid = ?";
-	getfirst(query.c_str(), 2, locationuuid.c_str(), roomuuid.c_str());
-	if (getroomlocation(roomuuid) == locationuuid) {
-		return 0;
+	std::map<string, RoomRecord>::iterator it = rooms.find(roomuuid);
+	if (it == rooms.end()) {
+		return locationuuid == "" ? 0 : -1;
 	}
-	return -1;
+	if (it->second.location == locationuuid) return 0;
+	if (!execute("update rooms set location = ? where uuid = ?", 2, locationuuid.c_str(), roomuuid.c_str())) return -1;
+	it->second.location = locationuuid;
+	return 0;
 }
 int Inventory::deletelocation(string uuid) {
-	string query = "update rooms set location = '' where location = ?";
-	getfirst(query.c_str(), 1, uuid.c_str());
-	query = "delete from locations where uuid = ?";
-	getfirst(query.c_str(), 1, uuid.c_str());
-	if (getlocationname(uuid) == "") {
-		return 0;
+	if (!begin()) return -1;
+	bool ok = execute("update rooms set location = '' where location = ?", 1, uuid.c_str())
+		&& execute("delete from locations where uuid = ?", 1, uuid.c_str());
+	if (!finish(ok)) return -1;
+
+	for (std::map<string, RoomRecord>::iterator it = rooms.begin(); it != rooms.end(); it++) {
+		if (it->second.location == uuid) it->second.location = "";
 	}
-	return -1;
+	return 0;
 }
 Variant::Map Inventory::getlocations() {
 	Variant::Map result;
 	sqlite3_stmt *stmt;
-	int rc;
 
-	rc = sqlite3_prepare_v2(db, "select uuid, name from locations", -1, &stmt, NULL);
-	if(rc!=SQLITE_OK) {
-                fprintf(stderr, "sql error #%d: %s\n", rc,sqlite3_errmsg(db));
-                return result;
-        }
-        while (sqlite3_step(stmt) == SQLITE_ROW) {
+	if ((stmt = prepare("select uuid, name from locations")) == NULL) return result;
+	while (sqlite3_step(stmt) == SQLITE_ROW) {
 		Variant::Map entry;
-		const char *locationname = (const char*)sqlite3_column_text(stmt, 1);
 		const char *uuid = (const char*)sqlite3_column_text(stmt, 0);
-		if (locationname != NULL) {
-			entry["name"] = string(locationname);
-		} else {
-			entry["name"] = "";
-		} 
+		entry["name"] = columntext(stmt, 1);
 		if (uuid != NULL) {
 			result[uuid] = entry;
 		}
 	}
-
-	sqlite3_finalize (stmt);
+	sqlite3_reset(stmt);
 
 	return result;
 }
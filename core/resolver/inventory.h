@@ -6,6 +6,7 @@
 #include <qpid/messaging/Address.h>
 
 #include <string>
+#include <map>
 
 #include <sqlite3.h>
 
@@ -16,6 +17,7 @@ using namespace qpid::types;
 class Inventory {
 	public:
 		Inventory(const char *dbfile);
+		~Inventory();
 
 		string getdevicename (string uuid);
 		string getdeviceroom (string uuid);
@@ -54,5 +56,31 @@ class Inventory {
 		sqlite3 *db;
 		string getfirst(const char *query);
 		string getfirst(const char *query, int n, ...);
+		bool execute(const char *query, int n, ...);
 		bool createTableIfNotExist(std::string tablename, std::string createquery);
+
+		// prepared statements by query text, kept until the Inventory is destroyed
+		std::map<std::string, sqlite3_stmt *> statements;
+		sqlite3_stmt *prepare(const char *query);
+		bool begin();
+		bool finish(bool ok);
+
+		// write-through mirror of the devices, rooms and floorplans tables, reads never hit sqlite
+		struct DeviceRecord {
+			string name;
+			string room;
+		};
+		struct RoomRecord {
+			string name;
+			string location;
+		};
+		struct FloorplanPosition {
+			int x;
+			int y;
+		};
+		std::map<string, DeviceRecord> devices;
+		std::map<string, RoomRecord> rooms;
+		std::map<string, string> floorplans; // uuid -> name
+		std::map<string, std::map<string, FloorplanPosition> > floorplanDevices; // floorplan -> device -> position
+		void loadMirror();
 };
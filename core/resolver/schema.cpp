@@ -10,45 +10,62 @@
 #include <fstream>
 #include "yaml-cpp/yaml.h"
 #include <string>
+#include <sstream>
+#include <vector>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "agoclient.h"
+#include "schema.h"
 
 using namespace std;
 using namespace qpid::messaging;
 using namespace qpid::types;
 
-/// Merge two Variant Lists.
-qpid::types::Variant::List mergeList(qpid::types::Variant::List a, qpid::types::Variant::List b) {
-	qpid::types::Variant::List result = a;
-	result.splice(result.begin(),b);
-	return result;
-} 
+// move the value of from into to, containers are swapped instead of copied
+static void moveVariant(Variant &to, Variant &from) {
+	if (from.getType() == VAR_MAP) {
+		to = Variant::Map();
+		to.asMap().swap(from.asMap());
+	} else if (from.getType() == VAR_LIST) {
+		to = Variant::List();
+		to.asList().swap(from.asList());
+	} else {
+		to = from;
+	}
+}
 
-qpid::types::Variant::Map mergeMap(qpid::types::Variant::Map a, qpid::types::Variant::Map b) {
-	qpid::types::Variant::Map result = a;
+/// Merge two Variant Lists in place, the elements of b are moved to the front of a.
+void mergeList(qpid::types::Variant::List &a, qpid::types::Variant::List &b) {
+	a.splice(a.begin(),b);
+} 
 
-	for (qpid::types::Variant::Map::const_iterator it = b.begin(); it != b.end(); it++) {
-		qpid::types::Variant::Map::const_iterator it_a = result.find(it->first);
-		if (it_a != result.end()) {
+/// Merge b into a in place. Maps and lists are merged recursively, other clashing values are
+/// turned into a list of both. b is consumed, its values are moved rather than copied.
+void mergeMap(qpid::types::Variant::Map &a, qpid::types::Variant::Map &b) {
+	for (qpid::types::Variant::Map::iterator it = b.begin(); it != b.end(); it++) {
+		qpid::types::Variant::Map::iterator it_a = a.find(it->first);
+		if (it_a != a.end()) {
 			if ((it_a->second.getType()==VAR_MAP) && (it->second.getType()==VAR_MAP)) {
-				result[it->first] = mergeMap(it_a->second.asMap(), it->second.asMap());
-                        } else if ((it_a->second.getType()==VAR_LIST) && (it->second.getType()==VAR_LIST)) {
-                                result[it->first] = mergeList(it_a->second.asList(), it->second.asList());
+				mergeMap(it_a->second.asMap(), it->second.asMap());
+			} else if ((it_a->second.getType()==VAR_LIST) && (it->second.getType()==VAR_LIST)) {
+				mergeList(it_a->second.asList(), it->second.asList());
 			} else {
-				qpid::types::Variant::List list;
-				list.push_front(it->second);
-				list.push_front(it_a->second);
-				result[it->first] = list;
+				qpid::types::Variant::List list(2);
+				moveVariant(list.front(), it_a->second);
+				moveVariant(list.back(), it->second);
+				it_a->second = qpid::types::Variant::List();
+				it_a->second.asList().swap(list);
 			}
 		} else {
-			result[it->first] = it->second;
+			moveVariant(a[it->first], it->second);
 		}
-
 	}
-
-	return result;
-
+	b.clear();
 }
 
-
 Variant::List sequenceToVariantList(const YAML::Node &node);
 
 Variant::Map mapToVariantMap(const YAML::Node &node) {
@@ -107,3 +124,102 @@ Variant::Map parseSchema(const char *file) {
 	}
 	return schema;
 }
+
+// bump when the snapshot layout or the merge semantics change
+#define SCHEMASNAPSHOTVERSION "1"
+
+// 64 bit FNV-1a
+static uint64_t fnv1a(const std::string &data) {
+	uint64_t hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < data.size(); i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+static bool readFile(const std::string &path, std::string &data) {
+	std::ifstream in(path.c_str(), std::ios::in | std::ios::binary);
+	if (!in) return false;
+	std::stringstream buffer;
+	buffer << in.rdbuf();
+	data = buffer.str();
+	return true;
+}
+
+// identifies one state of the schema directory: every file in load order with its mtime, size and content hash
+static std::string schemaFingerprint(const std::string &prefix, const std::vector<std::string> &files) {
+	std::stringstream key;
+	key << "agoschema " << SCHEMASNAPSHOTVERSION << "\n";
+	for (size_t i = 0; i < files.size(); i++) {
+		std::string path = prefix + files[i];
+		std::string data;
+		struct stat st;
+		if (stat(path.c_str(), &st) != 0 || !readFile(path, data)) return "";
+		key << files[i] << ":" << st.st_mtime << ":" << st.st_size << ":" << std::hex << fnv1a(data) << std::dec << "\n";
+	}
+	return key.str();
+}
+
+static bool loadSnapshot(const char *snapshot, const std::string &key, Variant::Map &schema) {
+	std::string data;
+	if (!readFile(snapshot, data)) return false;
+	Variant::Map content;
+	try {
+		Message message(data);
+		message.setContentType("amqp/map");
+		decode(message, content);
+	} catch (const std::exception &error) {
+		clog << agocontrol::kLogWarning << "can't decode schema snapshot: " << error.what() << std::endl;
+		return false;
+	}
+	if (content["key"].asString() != key || content["schema"].getType() != VAR_MAP) return false;
+	schema.swap(content["schema"].asMap());
+	return true;
+}
+
+static bool storeSnapshot(const char *snapshot, const std::string &key, const Variant::Map &schema) {
+	Variant::Map content;
+	Message message;
+	content["key"] = key;
+	content["schema"] = schema;
+	encode(content, message);
+
+	// write a temporary file and rename it, a crash never leaves a truncated snapshot behind
+	std::string tmpfile = std::string(snapshot) + ".tmp";
+	std::ofstream out(tmpfile.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+	out.write(message.getContentPtr(), message.getContentSize());
+	out.close();
+	if (out.fail() || rename(tmpfile.c_str(), snapshot) != 0) {
+		clog << agocontrol::kLogWarning << "can't write schema snapshot " << snapshot << std::endl;
+		unlink(tmpfile.c_str());
+		return false;
+	}
+	return true;
+}
+
+Variant::Map loadSchema(const std::string &prefix, const std::vector<std::string> &files, const char *snapshot) {
+	Variant::Map schema;
+	std::string key = schemaFingerprint(prefix, files);
+	if (key != "" && loadSnapshot(snapshot, key, schema)) {
+		clog << agocontrol::kLogDebug << "loaded schema snapshot " << snapshot << std::endl;
+		return schema;
+	}
+
+	for (size_t i = 0; i < files.size(); i++) {
+		std::string schemaFile = prefix + files[i];
+		clog << agocontrol::kLogDebug << "parsing schema file:" << schemaFile << std::endl;
+		Variant::Map additional = parseSchema(schemaFile.c_str());
+		mergeMap(schema, additional);
+	}
+	if (key != "") storeSnapshot(snapshot, key, schema);
+	return schema;
+}
+
+std::string hashSchema(const Variant::Map &schema) {
+	Message message;
+	encode(schema, message);
+	std::stringstream version;
+	version << std::hex << fnv1a(message.getContent());
+	return version.str();
+}
@@ -10,14 +10,19 @@
 #include <fstream>
 #include "yaml-cpp/yaml.h"
 #include <string>
+#include <vector>
 
 using namespace std;
 using namespace qpid::messaging;
 using namespace qpid::types;
 
-qpid::types::Variant::List mergeList(qpid::types::Variant::List a, qpid::types::Variant::List b);
-qpid::types::Variant::Map mergeMap(qpid::types::Variant::Map a, qpid::types::Variant::Map b);
+void mergeList(qpid::types::Variant::List &a, qpid::types::Variant::List &b);
+void mergeMap(qpid::types::Variant::Map &a, qpid::types::Variant::Map &b);
 Variant::List sequenceToVariantList(const YAML::Node &node);
 Variant::Map mapToVariantMap(const YAML::Node &node);
 Variant::Map parseSchema(const char *filename);
+/// parse and merge the schema files in order, or load the result from the snapshot if none of them changed
+Variant::Map loadSchema(const std::string &prefix, const std::vector<std::string> &files, const char *snapshot);
+/// content hash of a merged schema, served as its version so clients only fetch it when it changed
+std::string hashSchema(const Variant::Map &schema);
 
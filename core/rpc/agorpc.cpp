@@ -17,20 +17,27 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <ctype.h>
 
 #include <termios.h>
 #ifndef __FreeBSD__
 #include <malloc.h>
 #endif
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
+#include <stdarg.h>
+#include <sys/time.h>
 
 #include <sstream>
 #include <map>
-#include <deque>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
 
 #include <uuid/uuid.h>
+#include <zlib.h>
 
 #include <qpid/messaging/Connection.h>
 #include <qpid/messaging/Message.h>
@@ -39,10 +46,6 @@
 #include <qpid/messaging/Session.h>
 #include <qpid/messaging/Address.h>
 
-#include <jsoncpp/json/value.h>
-#include <jsoncpp/json/reader.h>
-#include <jsoncpp/json/writer.h>
-
 #include "agoclient.h"
 
 
@@ -51,113 +54,320 @@ using namespace qpid::messaging;
 using namespace qpid::types;
 using namespace agocontrol; 
 
-// qpid session and sender/receiver
+// qpid session and receiver for the event loop
 Receiver receiver;
-Sender sender;
 Session session;
 Connection *connection;
 
+// bus bridge for the http threads: requests go out through a pool of long-lived sessions, replies
+// come back on one shared reply queue and are matched by correlation id
+struct PooledSender
+{
+	Session session;
+	Sender sender;
+	pthread_mutex_t mutex; // one thread at a time sends through it
+};
+vector<PooledSender*> senderPool;
+unsigned int nextPooledSender = 0;
+pthread_mutex_t mutexSenderPool;
+ReplyMultiplexer *replies = NULL;
+
 // context for embedded web server
 struct mg_context       *ctx;
 
 
-// struct and map for json-rpc event subscriptions
+// events are serialized to JSON once and shared by all subscribers: the last eventBufferSize
+// events are kept in a ring, event number n in slot n % eventBufferSize
+typedef boost::shared_ptr<const string> SharedEvent;
+vector<SharedEvent> eventRing;
+unsigned long long eventHead = 0; // number of the next event
+pthread_cond_t eventCond; // broadcast when an event is added or a subscriber is removed
+
+// struct and map for json-rpc event subscriptions and /update streams
 struct Subscriber
 {
-	deque<Variant::Map> queue;
+	unsigned long long cursor; // number of the next event this subscriber gets
 	time_t lastAccess;
+	int users; // getevent calls and streams working with it, see acquireSubscriber()
+	bool removed; // dropped from subscriptions while in use, the last user frees it
 };
 
-map<string,Subscriber> subscriptions;
-pthread_mutex_t mutexSubscriptions;
+map<string,Subscriber*> subscriptions;
+pthread_mutex_t mutexSubscriptions; // guards the event ring, subscriptions and all subscribers
+
+#define EVENT_WAIT 0
+#define EVENT_READY 1
+#define EVENT_REMOVED -1
+
+// seconds a getevent call waits for an event when the client doesn't say, and the upper limit
+#define GETEVENT_TIMEOUT 30
+#define GETEVENT_MAXTIMEOUT 300
+// an idle stream sends a comment this often, a write error tells us the client is gone
+#define STREAM_KEEPALIVE 15
+// subscriptions not polled for this many seconds are abandoned and get removed
+#define SUBSCRIPTION_TIMEOUT 600
+
+// last inventory reply rendered to JSON for the web UI, dropped by events which change the inventory
+// and kept at most inventoryMaxAge seconds, stale marks and system info change without events
+boost::shared_ptr<const string> inventoryJSON;
+string inventoryETag;
+time_t inventoryFetched = 0;
+unsigned long inventoryGeneration = 0; // bumped by every invalidation
+int inventoryMaxAge = 60;
+pthread_mutex_t mutexInventory;
+
+// optional schema check of commands before they are put on the bus, enabled with validatecommands
+// in the rpc section. the schema comes from the resolver, device types from the inventory and announces.
+bool validateCommands = false;
+SchemaIndex schemaIndex;
+string schemaVersion;
+map<string,string> deviceTypes; // uuid -> devicetype
+bool inventoryLoaded = false; // only used by the schema thread
+pthread_mutex_t mutexSchema;
+
+// replies are rendered into a string and sent with a single write, see sendReply()
+bool compressReplies = true;
+// message calls of a batch in flight at once, and seconds the whole batch may wait for replies
+int batchConcurrency = 8;
+int batchTimeout = 10;
+// largest accepted /jsonrpc request body, bytes
+unsigned long maxRequestSize = 4194304;
+// smaller replies are not worth compressing
+#define GZIP_MINSIZE 1024
+
+// printf into a reply buffer
+static void appendf(string &out, const char *format, ...) {
+	char buffer[1024];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	if (len < 0) return;
+	if ((size_t)len < sizeof(buffer)) {
+		out.append(buffer, len);
+		return;
+	}
+	vector<char> large(len + 1);
+	va_start(args, format);
+	vsnprintf(&large[0], large.size(), format, args);
+	va_end(args);
+	out.append(&large[0], len);
+}
 
-// helper to determine last element
-template <typename Iter>
-Iter next(Iter iter)
-{
-    return ++iter;
+// gzip in into out, false when zlib fails
+static bool gzipString(const string &in, string &out) {
+	z_stream stream;
+	memset(&stream, 0, sizeof(stream));
+	// 16 added to the window bits selects the gzip instead of the zlib wrapper
+	if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) return false;
+	out.resize(deflateBound(&stream, in.size()) + 32);
+	stream.next_in = (Bytef *)in.data();
+	stream.avail_in = in.size();
+	stream.next_out = (Bytef *)&out[0];
+	stream.avail_out = out.size();
+	int result = deflate(&stream, Z_FINISH);
+	out.resize(stream.total_out);
+	deflateEnd(&stream);
+	return result == Z_STREAM_END;
+}
+
+// build a 200 response with Content-Length, body gzipped when acceptEncoding (or NULL) allows it
+static void buildReply(string &reply, const char *acceptEncoding, const char *contentType, const string &body, const string &headers) {
+	reply = "HTTP/1.1 200 OK\r\n"
+		"Cache: no-cache\r\n"
+		"Access-Control-Allow-Origin: *\r\n"
+		"Content-Type: ";
+	reply += contentType;
+	reply += "\r\n";
+	reply += headers;
+	string compressed;
+	const string *content = &body;
+	if (compressReplies) {
+		if (body.size() >= GZIP_MINSIZE && acceptEncoding != NULL && strstr(acceptEncoding, "gzip") != NULL && gzipString(body, compressed)) {
+			reply += "Content-Encoding: gzip\r\n";
+			content = &compressed;
+		}
+		reply += "Vary: Accept-Encoding\r\n";
+	}
+	appendf(reply, "Content-Length: %lu\r\n\r\n", (unsigned long)content->size());
+	reply += *content;
+}
+
+// send a complete reply with one write, headers are added as they are, each one terminated by \r\n
+static void sendReply(struct mg_connection *conn, const char *contentType, const string &body, const string &headers = "") {
+	string reply;
+	buildReply(reply, mg_get_header(conn, "Accept-Encoding"), contentType, body, headers);
+	mg_write(conn, reply.data(), reply.size());
+}
+
+// new subscribers start with the next event, mutexSubscriptions must be held
+static Subscriber *createSubscriber() {
+	Subscriber *subscriber = new Subscriber;
+	subscriber->cursor = eventHead;
+	subscriber->lastAccess = time(0);
+	subscriber->users = 0;
+	subscriber->removed = false;
+	return subscriber;
+}
+
+static void deleteSubscriber(Subscriber *subscriber) {
+	delete subscriber;
+}
+
+// add an event to the ring and wake all waiting subscribers, mutexSubscriptions must be held.
+// the oldest event is overwritten, subscribers still behind it notice by their cursor
+static void publishEvent(const SharedEvent &event) {
+	eventRing[eventHead % eventRing.size()] = event;
+	eventHead++;
+	pthread_cond_broadcast(&eventCond);
+}
+
+// drop a subscriber from the map, mutexSubscriptions must be held. it is freed right away
+// or, when it is in use, by its last user
+static void removeSubscriber(map<string,Subscriber*>::iterator it) {
+	Subscriber *subscriber = it->second;
+	subscriptions.erase(it);
+	if (subscriber->users > 0) {
+		subscriber->removed = true;
+		pthread_cond_broadcast(&eventCond);
+	} else {
+		deleteSubscriber(subscriber);
+	}
 }
 
-static const char *ajax_reply_start =
+// keep a subscriber alive while the lock is released, mutexSubscriptions must be held
+static void acquireSubscriber(Subscriber *subscriber) {
+	subscriber->users++;
+}
+
+// counterpart of acquireSubscriber(), frees a subscriber that was removed meanwhile
+static void releaseSubscriber(Subscriber *subscriber) {
+	if (--subscriber->users == 0 && subscriber->removed) deleteSubscriber(subscriber);
+}
+
+// wait up to timeout seconds for the next event of an acquired subscriber, mutexSubscriptions
+// must be held. returns EVENT_READY with the event JSON, EVENT_WAIT on timeout or EVENT_REMOVED
+// when the subscriber was removed meanwhile. a subscriber which fell behind the ring gets an
+// event.rpc.eventslost event with the number of missed events and continues with the oldest one.
+static int waitForEvent(Subscriber *subscriber, SharedEvent &event, unsigned int timeout) {
+	struct timeval now;
+	struct timespec deadline;
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + timeout;
+	deadline.tv_nsec = now.tv_usec * 1000;
+
+	while (subscriber->cursor == eventHead && !subscriber->removed) {
+		if (pthread_cond_timedwait(&eventCond, &mutexSubscriptions, &deadline) == ETIMEDOUT) break;
+	}
+	if (subscriber->removed) return EVENT_REMOVED;
+	subscriber->lastAccess = time(0);
+	if (subscriber->cursor == eventHead) return EVENT_WAIT;
+	unsigned long long oldest = eventHead > eventRing.size() ? eventHead - eventRing.size() : 0;
+	if (subscriber->cursor < oldest) {
+		stringstream lost;
+		lost << "{\"event\":\"event.rpc.eventslost\",\"count\":" << oldest - subscriber->cursor << "}";
+		subscriber->cursor = oldest;
+		event.reset(new string(lost.str()));
+		return EVENT_READY;
+	}
+	event = eventRing[subscriber->cursor % eventRing.size()];
+	subscriber->cursor++;
+	return EVENT_READY;
+}
+
+static const char *stream_reply_start =
   "HTTP/1.1 200 OK\r\n"
-  "Cache: no-cache\r\n"
+  "Cache-Control: no-cache\r\n"
   "Access-Control-Allow-Origin: *\r\n"
-  "Content-Type: application/x-javascript; charset=utf-8\r\n"
-  "\r\n";
+  "Content-Type: text/event-stream; charset=utf-8\r\n"
+  "\r\n"
+  "retry: 3000\n\n";
 
-// json-print qpid Variant Map and List via mongoose
-void mg_printmap(struct mg_connection *conn, Variant::Map map);
+// Server-Sent Events stream of all events, one connection instead of a getevent call per event
+static void update (struct mg_connection *conn, const struct mg_request_info *request_info) {
+	mg_printf(conn, "%s", stream_reply_start);
 
-void mg_printlist(struct mg_connection *conn, Variant::List list) {
-	mg_printf(conn, "[");
-	for (Variant::List::const_iterator it = list.begin(); it != list.end(); ++it) {
-		switch(it->getType()) {
-			case VAR_MAP:
-				mg_printmap(conn, it->asMap());
-				break;
-			case VAR_STRING:
-				mg_printf(conn, "\"%s\"", it->asString().c_str());	
-				break;
-			default:
-				if (it->asString().size() != 0) {
-					mg_printf(conn, "%s", it->asString().c_str());	
-				} else {
-					mg_printf(conn, "null");
-				}
+	string subscriberName = generateUuid();
+	pthread_mutex_lock(&mutexSubscriptions);
+	Subscriber *subscriber = createSubscriber();
+	subscriptions[subscriberName] = subscriber;
+	acquireSubscriber(subscriber);
+	while (true) {
+		SharedEvent event;
+		int result = waitForEvent(subscriber, event, STREAM_KEEPALIVE);
+		if (result == EVENT_REMOVED) break;
+		pthread_mutex_unlock(&mutexSubscriptions);
+		bool open;
+		if (result == EVENT_READY) {
+			string data = "data: " + *event + "\n\n";
+			open = mg_write(conn, data.c_str(), data.size()) > 0;
+		} else {
+			open = mg_printf(conn, ": keepalive\n\n") > 0;
+		}
+		pthread_mutex_lock(&mutexSubscriptions);
+		if (subscriber->removed) break;
+		if (!open) {
+			map<string,Subscriber*>::iterator it = subscriptions.find(subscriberName);
+			if (it != subscriptions.end()) removeSubscriber(it);
+			break;
 		}
-		if ((it != list.end()) && (next(it) != list.end())) mg_printf(conn, ",");
 	}
-	mg_printf(conn, "]");
+	releaseSubscriber(subscriber);
+	pthread_mutex_unlock(&mutexSubscriptions);
 }
-void mg_printmap(struct mg_connection *conn, Variant::Map map) {
-	mg_printf(conn, "{");
-	for (Variant::Map::const_iterator it = map.begin(); it != map.end(); ++it) {
-		mg_printf(conn, "\"%s\":", it->first.c_str());
-		switch (it->second.getType()) {
-			case VAR_MAP:
-				mg_printmap(conn, it->second.asMap());
-				break;
-			case VAR_LIST:
-				mg_printlist(conn, it->second.asList());
-				break;
-			case VAR_STRING:
-				mg_printf(conn, "\"%s\"", it->second.asString().c_str());	
-				break;
-			default:
-				if (it->second.asString().size() != 0) {
-					mg_printf(conn, "%s", it->second.asString().c_str());	
-				} else {
-					mg_printf(conn, "null");
-				}
+
+// open the sender pool and the shared reply queue, false when the broker is not available
+static bool createBridge(int sessions) {
+	pthread_mutex_init(&mutexSenderPool, NULL);
+	try {
+		for (int i = 0; i < sessions; i++) {
+			PooledSender *pooled = new PooledSender;
+			pooled->session = connection->createSession();
+			pooled->sender = pooled->session.createSender("agocontrol; {create: always, node: {type: topic}}");
+			pthread_mutex_init(&pooled->mutex, NULL);
+			senderPool.push_back(pooled);
 		}
-		if ((it != map.end()) && (next(it) != map.end())) mg_printf(conn, ",");
+	} catch(const std::exception& error) {
+		std::cerr << "can't create sender pool: " << error.what() << std::endl;
+		return false;
 	}
-	mg_printf(conn, "}");
+	// requests of all clients share the queue, replies without correlation id are dropped
+	replies = new ReplyMultiplexer(*connection);
+	return true;
 }
 
-static void update (struct mg_connection *conn, const struct mg_request_info *request_info) {
-	mg_printf(conn, "%s", "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n");
-	Receiver myReceiver = session.createReceiver("agocontrol; {create: always, node: {type: topic}}");
-
-	while(true) {
-		try {
-			Message receiveMessage = myReceiver.fetch(Duration::SECOND * 3);
-			session.acknowledge(receiveMessage);
-			if (receiveMessage.getContentSize() > 3) {	
-				Variant::Map receiveMap;
-				decode(receiveMessage,receiveMap);
-				mg_printmap(conn, receiveMap);
-				mg_printf(conn, "\r\n");
-			} else  {
-				mg_printf(conn, "%s:%s", receiveMessage.getSubject().c_str(),receiveMessage.getContent().c_str());
-			}
+// send a message to the bus through the next pooled sender. with correlationId it carries our reply
+// address and correlationId is set to collect the reply with bridgeWait(), without it nobody waits for one.
+static bool bridgeSend(Message &message, string *correlationId) {
+	pthread_mutex_lock(&mutexSenderPool);
+	PooledSender *pooled = senderPool[nextPooledSender++ % senderPool.size()];
+	pthread_mutex_unlock(&mutexSenderPool);
 
-		} catch (qpid::messaging::NoMessageAvailable) {
-			printf("WARNING, no reply message to fetch\n");
-		}
+	bool result = true;
+	pthread_mutex_lock(&pooled->mutex);
+	try {
+		if (correlationId != NULL) *correlationId = replies->send(pooled->sender, message);
+		else pooled->sender.send(message);
+	} catch(const std::exception& error) {
+		std::cerr << "can't send request: " << error.what() << std::endl;
+		result = false;
 	}
+	pthread_mutex_unlock(&pooled->mutex);
+	return result;
+}
+
+// wait for the reply to a request sent with bridgeSend(), false on timeout
+static bool bridgeWait(const string &correlationId, Message &response, Duration timeout) {
+	return replies->wait(correlationId, response, timeout);
+}
 
+// send a request and wait for its reply
+static bool bridgeRequest(Message &message, Message &response, Duration timeout) {
+	string correlationId;
+	if (!bridgeSend(message, &correlationId)) return false;
+	return bridgeWait(correlationId, response, timeout);
 }
+
 static void command (struct mg_connection *conn, const struct mg_request_info *request_info) {
 	char uuid[1024], command[1024], level[1024];
 	Variant::Map agocommand;
@@ -171,223 +381,457 @@ static void command (struct mg_connection *conn, const struct mg_request_info *r
 
 	encode(agocommand, message);
 
-	Address responseQueue("#response-queue; {create:always, delete:always}");
-	Receiver responseReceiver = session.createReceiver(responseQueue);
-	message.setReplyTo(responseQueue);
-
-	sender.send(message);
-	
-	mg_printf(conn, "%s", "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n\r\n");
-	try {
-		Message response = responseReceiver.fetch(Duration::SECOND * 3);
-		session.acknowledge(response);
+	string reply;
+	Message response;
+	if (bridgeRequest(message, response, Duration::SECOND * 3)) {
 		if (response.getContentSize() > 3) {	
 			Variant::Map responseMap;
 			decode(response,responseMap);
-			mg_printmap(conn, responseMap);
+			variantMapToJSON(responseMap, reply);
 		} else  {
-			mg_printf(conn, "%s", response.getContent().c_str());
+			reply = response.getContent();
 		}
-
-	} catch (qpid::messaging::NoMessageAvailable) {
+	} else {
 		printf("WARNING, no reply message to fetch\n");
 	}
+	sendReply(conn, "text/plain", reply);
+}
+
+// look up a member of a parsed JSON object, returns a void Variant when it is absent
+static const Variant noValue;
+static const Variant &getMember(const Variant::Map &map, const char *name) {
+	Variant::Map::const_iterator it = map.find(name);
+	return it != map.end() ? it->second : noValue;
+}
+
+// send a request to the resolver and wait for its reply
+static bool resolverRequest(const Variant::Map &content, Variant::Map &reply) {
+	Message message;
+	Message response;
+	encode(content, message);
+	if (!bridgeRequest(message, response, Duration::SECOND * 3) || response.getContentSize() <= 3) {
+		std::cerr << "no reply from resolver to " << content.find("command")->second.asString() << std::endl;
+		return false;
+	}
+	decode(response, reply);
+	return true;
+}
+
+// events which change the resolver's inventory
+static bool changesInventory(const string &subject) {
+	return subject.find("event.device.") == 0 || subject.find("event.system.") == 0
+		|| subject.find("event.environment.") == 0 || subject == "event.security.sensortriggered";
+}
+
+static void invalidateInventory() {
+	pthread_mutex_lock(&mutexInventory);
+	inventoryGeneration++;
+	inventoryJSON.reset();
+	pthread_mutex_unlock(&mutexInventory);
+}
+
+// current inventory as JSON with its entity tag, from the cache or fetched from the resolver.
+// a reply is only cached when no invalidation happened while it was on its way.
+static bool getInventoryJSON(boost::shared_ptr<const string> &json, string &etag) {
+	pthread_mutex_lock(&mutexInventory);
+	if (inventoryJSON && time(NULL) - inventoryFetched < inventoryMaxAge) {
+		json = inventoryJSON;
+		etag = inventoryETag;
+		pthread_mutex_unlock(&mutexInventory);
+		return true;
+	}
+	unsigned long generation = inventoryGeneration;
+	pthread_mutex_unlock(&mutexInventory);
+
+	Variant::Map content;
+	Variant::Map reply;
+	content["command"] = "inventory";
+	if (!resolverRequest(content, reply)) return false;
+	string *rendered = new string();
+	variantMapToJSON(reply, *rendered);
+	json.reset(rendered);
+	// FNV-1a of the JSON, clients revalidate with If-None-Match
+	uint64_t hash = 14695981039346656037ULL;
+	for (string::const_iterator it = rendered->begin(); it != rendered->end(); it++) {
+		hash ^= (unsigned char)*it;
+		hash *= 1099511628211ULL;
+	}
+	etag.clear();
+	appendf(etag, "\"%016llx\"", (unsigned long long)hash);
+
+	pthread_mutex_lock(&mutexInventory);
+	if (generation == inventoryGeneration) {
+		inventoryJSON = json;
+		inventoryETag = etag;
+		inventoryFetched = time(NULL);
+	}
+	pthread_mutex_unlock(&mutexInventory);
+	return true;
+}
+
+// fetch the inventory once, later only ask for the schema, the resolver leaves it out while our version is current
+static bool syncSchema() {
+	Variant::Map content;
+	Variant::Map reply;
+	content["command"] = inventoryLoaded ? "getschema" : "inventory";
+	pthread_mutex_lock(&mutexSchema);
+	content["schemaversion"] = schemaVersion;
+	pthread_mutex_unlock(&mutexSchema);
+	if (!resolverRequest(content, reply)) return false;
+
+	pthread_mutex_lock(&mutexSchema);
+	if (reply["schema"].getType() == VAR_MAP) {
+		schemaIndex.build(reply["schema"].asMap());
+		schemaVersion = reply["schemaversion"].asString();
+	}
+	if (reply["devices"].getType() == VAR_MAP) {
+		const Variant::Map &devices = reply["devices"].asMap();
+		for (Variant::Map::const_iterator it = devices.begin(); it != devices.end(); it++) {
+			if (it->second.getType() != VAR_MAP) continue;
+			Variant::Map::const_iterator type = it->second.asMap().find("devicetype");
+			if (type != it->second.asMap().end()) deviceTypes[it->first] = type->second.asString();
+		}
+		inventoryLoaded = true;
+	}
+	pthread_mutex_unlock(&mutexSchema);
+	return true;
+}
+
+// syncs the schema every minute on its own thread, a resolver that doesn't answer can't hold up the event
+// loop. failed syncs are retried after 5s, doubling up to 5 minutes
+static void *schemaSyncer(void *param) {
+	unsigned int delay = 5;
+	while (true) {
+		if (syncSchema()) {
+			delay = 5;
+			sleep(60);
+		} else {
+			sleep(delay);
+			if (delay < 300) delay = delay * 2 < 300 ? delay * 2 : 300;
+		}
+	}
+	return NULL;
+}
+
+// keep the device types current from announce and remove events
+static void trackDeviceTypes(const string &subject, Variant::Map &content) {
+	pthread_mutex_lock(&mutexSchema);
+	if (subject == "event.device.announce") {
+		deviceTypes[content["uuid"].asString()] = content["devicetype"].asString();
+	} else if (subject == "event.device.announcelist" && content["devices"].getType() == VAR_MAP) {
+		Variant::Map &devices = content["devices"].asMap();
+		for (Variant::Map::iterator it = devices.begin(); it != devices.end(); it++) {
+			if (it->second.getType() == VAR_MAP) deviceTypes[it->first] = it->second.asMap()["devicetype"].asString();
+		}
+	} else if (subject == "event.device.remove") {
+		deviceTypes.erase(content["uuid"].asString());
+	}
+	pthread_mutex_unlock(&mutexSchema);
+}
 
-        try {
-                responseReceiver.close();
-        } catch(const std::exception& error) {
-                std::cerr << error.what() << std::endl;
-        }
+// false with the reason in error if the schema rejects a command. commands for devices or
+// device types we know nothing about are passed on, the resolver may just know more than we do.
+static bool commandValid(const Variant &content, const Variant &subject, string &error) {
+	if (content.getType() != VAR_MAP || (subject.getType() == VAR_STRING && subject.asString() != "")) return true;
+	const Variant &uuid = getMember(content.asMap(), "uuid");
+	if (uuid.isVoid()) return true;
+	bool result = true;
+	pthread_mutex_lock(&mutexSchema);
+	map<string,string>::const_iterator device = deviceTypes.find(uuid.asString());
+	if (device != deviceTypes.end() && schemaIndex.hasDevicetype(device->second)) {
+		result = schemaIndex.validateCommand(device->second, content.asMap(), error);
+	}
+	pthread_mutex_unlock(&mutexSchema);
+	return result;
+}
 
+static uint64_t nowMilliseconds() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
 }
 
-bool jsonrpcRequestHandler(struct mg_connection *conn, Json::Value request, bool firstElem) {
-	Json::StyledWriter writer;
+// a message call sent to the bus, its reply is still to be collected with collectReply()
+struct PendingCall
+{
 	string myId;
-	const Json::Value id = request.get("id", Json::Value());
-	const string method = request.get("method", "message").asString();
-	const string version = request.get("jsonrpc", "unspec").asString();
-	bool result;
+	string correlationId; // empty when nothing is pending
+	uint64_t deadline; // milliseconds, replytimeout after sending
+};
 
-	myId = writer.write(id);
+// wait for the reply of a pending call until its own deadline or the given one, whichever comes
+// first (0 for none), and append the JSON-RPC reply to out
+static void collectReply(const PendingCall &call, uint64_t deadline, string &out) {
+	if (deadline == 0 || call.deadline < deadline) deadline = call.deadline;
+	uint64_t now = nowMilliseconds();
+	Message response;
+	if (!bridgeWait(call.correlationId, response, Duration(deadline > now ? deadline - now : 0))) {
+		printf("WARNING, no reply message to fetch\n");
+		appendf(out, "{\"jsonrpc\": \"2.0\", \"result\": \"no-reply\", \"id\": %s}",call.myId.c_str());
+		return;
+	}
+	try {
+		if (response.getContentSize() > 3) {	
+			Variant::Map responseMap;
+			decode(response,responseMap);
+			out += "{\"jsonrpc\": \"2.0\", \"result\": ";
+			variantMapToJSON(responseMap, out);
+			appendf(out, ", \"id\": %s}",call.myId.c_str());
+		} else  {
+			out += "{\"jsonrpc\": \"2.0\", \"result\": ";
+			variantToJSON(Variant(response.getContent()), out);
+			appendf(out, ", \"id\": %s}",call.myId.c_str());
+		}
+	} catch ( const std::exception& error) {
+		cout << "EXCEPTION: " << error.what() << endl;
+		out += "{\"jsonrpc\": \"2.0\", \"result\": ";
+		variantToJSON(Variant(string("exception: ") + error.what()), out);
+		appendf(out, ", \"id\": %s}",call.myId.c_str());
+	}
+}
+
+// handle a single JSON-RPC request, the reply is appended to out. notifications to message get no reply.
+// with pending, a message call only gets sent and is left in pending for the caller to collect.
+static void jsonrpcRequestHandler(const Variant::Map &request, string &out, PendingCall *pending = NULL) {
+	string myId;
+	const Variant &id = getMember(request, "id");
+	const Variant &methodValue = getMember(request, "method");
+	const Variant &versionValue = getMember(request, "jsonrpc");
+	const string method = methodValue.isVoid() ? "message" : methodValue.asString();
+	const string version = versionValue.isVoid() ? "unspec" : versionValue.asString();
+
+	if (id.isVoid()) myId = "null";
+	else variantToJSON(id, myId);
 	if (version == "2.0") {
-		const Json::Value params = request.get("params", Json::Value());
+		const Variant &params = getMember(request, "params");
 		if (method == "message" ) {
-			if (params.isObject()) {
-				Session tmpSession;
-				Sender tmpSender;
-				try {
-					tmpSession = connection->createSession();
-					tmpSender = tmpSession.createSender("agocontrol; {create: always, node: {type: topic}}"); 
-				} catch ( qpid::messaging::MessagingException) {
-					cout << "ERROR: Can't create session/sender" << endl;
-					mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"result\": \"exception: %s\", \"id\": %s}","qpid::messaging::MessagingException",myId.c_str());
-					return false;		
+			if (params.getType() == VAR_MAP) {
+				string invalid;
+				if (validateCommands && !commandValid(getMember(params.asMap(), "content"), getMember(params.asMap(), "subject"), invalid)) {
+					string errorMessage;
+					variantToJSON(Variant(invalid), errorMessage);
+					appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":%s}, \"id\": %s}", errorMessage.c_str(), myId.c_str());
+					return;
 				}
-				Json::Value content = params["content"];
-				Json::Value subject = params["subject"];
-				Json::Value replytimeout = params["replytimeout"];
+				const Variant &content = getMember(params.asMap(), "content");
+				const Variant &subject = getMember(params.asMap(), "subject");
+				const Variant &replytimeout = getMember(params.asMap(), "replytimeout");
 				qpid::messaging::Duration timeout = Duration::SECOND * 3;
-				if (replytimeout.isInt()) {
-					timeout = Duration::SECOND * replytimeout.asInt();
+				if (replytimeout.getType() == VAR_INT32) {
+					timeout = Duration::SECOND * replytimeout.asInt32();
 				}
 					
-				Variant::Map command = jsonToVariantMap(content);
-				Variant::Map responseMap;
-				Message message;
-				encode(command, message);
-
-				Address responseQueue("#response-queue; {create:always, delete:always}");
-				Receiver responseReceiver = tmpSession.createReceiver(responseQueue);
-				message.setReplyTo(responseQueue);
-				if (subject.isString()) message.setSubject(subject.asString());
-
-				tmpSender.send(message);
-				try {
-					Message response = responseReceiver.fetch(timeout);
-					cout << "Response received" << endl;
-					tmpSession.acknowledge();
-					responseReceiver.close();
-					cout << "Response acknowledged, receiver closed" << endl;
-					if (!(id.isNull())) { // only send reply when id is not null
-						result = true;
-						cout << "sending json-rpc response" << endl;
-						if (!firstElem) mg_printf(conn, ",");
-						if (response.getContentSize() > 3) {	
-							cout << "decoding message into map" << endl;
-							decode(response,responseMap);
-							cout << "Response: " << responseMap << endl;
-							mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"result\": ");
-							mg_printmap(conn, responseMap);
-							mg_printf(conn, ", \"id\": %s}",myId.c_str());
-						} else  {
-							cout << "Response: " << response.getContent() << endl;
-							mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"result\": \"");
-							mg_printf(conn, "%s", response.getContent().c_str());
-							mg_printf(conn, "\", \"id\": %s}",myId.c_str());
-						}
+				Variant::Map command;
+				if (content.getType() == VAR_MAP) command = content.asMap();
+				if (!id.isVoid() && command.size() == 1 && command["command"] == "inventory" && subject.isVoid()) {
+					// plain inventory request of the web UI, answered from the cache
+					boost::shared_ptr<const string> json;
+					string etag;
+					if (getInventoryJSON(json, etag)) {
+						out += "{\"jsonrpc\": \"2.0\", \"result\": " + *json + ", \"id\": " + myId + "}";
 					} else {
-						cout << "No id given, not sending response" << endl;
-						result = false;
+						appendf(out, "{\"jsonrpc\": \"2.0\", \"result\": \"no-reply\", \"id\": %s}",myId.c_str());
 					}
+					return;
+				}
+				Message message;
+				encode(command, message);
+				if (subject.getType() == VAR_STRING) message.setSubject(subject.asString());
 
-				} catch (qpid::messaging::NoMessageAvailable) {
-					printf("WARNING, no reply message to fetch\n");
-					mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"result\": \"no-reply\", \"id\": %s}",myId.c_str());
-				} catch ( const std::exception& error) {
-					stringstream errorstring;
-					errorstring << error.what();
-					cout << "EXCEPTION: " << errorstring.str() << endl;
-					mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"result\": \"exception: %s\", \"id\": %s}",errorstring.str().c_str(),myId.c_str());
+				if (id.isVoid()) {
+					// notification, nobody is interested in the reply
+					if (!bridgeSend(message, NULL)) cout << "ERROR: can't send notification" << endl;
+					return;
+				}
+				PendingCall call;
+				call.myId = myId;
+				call.deadline = nowMilliseconds() + timeout.getMilliseconds();
+				if (!bridgeSend(message, &call.correlationId)) {
+					appendf(out, "{\"jsonrpc\": \"2.0\", \"result\": \"exception: %s\", \"id\": %s}","qpid::messaging::MessagingException",myId.c_str());
+					return;
 				}
-				tmpSession.close();
-				
+				if (pending != NULL) *pending = call;
+				else collectReply(call, 0, out);
 			} else {
-				mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params\"}, \"id\": %s}",myId.c_str());
+				appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params\"}, \"id\": %s}",myId.c_str());
 			}
 		
 		} else if (method == "subscribe") {
 			string subscriberName = generateUuid();
-			if (id.isNull()) {
+			if (id.isVoid()) {
 				// JSON-RPC notification is invalid here as we need to return the subscription UUID somehow..
-				mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32600,\"message\":\"Invalid Request\"}, \"id\": %s}",myId.c_str());
+				appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32600,\"message\":\"Invalid Request\"}, \"id\": %s}",myId.c_str());
 			} else if (subscriberName != "") {
-				deque<Variant::Map> empty;
-				Subscriber subscriber;
-				subscriber.lastAccess=time(0);
-				subscriber.queue = empty;
 				pthread_mutex_lock(&mutexSubscriptions);	
-				subscriptions[subscriberName] = subscriber;
+				subscriptions[subscriberName] = createSubscriber();
 				pthread_mutex_unlock(&mutexSubscriptions);	
-				mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"result\": \"%s\", \"id\": %s}",subscriberName.c_str(), myId.c_str());
+				appendf(out, "{\"jsonrpc\": \"2.0\", \"result\": \"%s\", \"id\": %s}",subscriberName.c_str(), myId.c_str());
 			} else {
 				// uuid is empty so malloc probably failed, we seem to be out of memory
-				mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32000,\"message\":\"Out of memory\"}, \"id\": %s}",myId.c_str());
+				appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32000,\"message\":\"Out of memory\"}, \"id\": %s}",myId.c_str());
 			}
 
 		} else if (method == "unsubscribe") {
-			if (params.isObject()) {
-				Json::Value content = params["uuid"];
-				if (content.isString()) {
+			if (params.getType() == VAR_MAP) {
+				const Variant &content = getMember(params.asMap(), "uuid");
+				if (content.getType() == VAR_STRING) {
 					cout << "removing subscription: " << content.asString() << endl;
 					pthread_mutex_lock(&mutexSubscriptions);	
-					map<string,Subscriber>::iterator it = subscriptions.find(content.asString());
-					if (it != subscriptions.end()) {
-						Subscriber *sub = &(it->second);
-						subscriptions.erase(content.asString());
-					}
+					map<string,Subscriber*>::iterator it = subscriptions.find(content.asString());
+					if (it != subscriptions.end()) removeSubscriber(it);
 					pthread_mutex_unlock(&mutexSubscriptions);	
-					mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"result\": \"success\", \"id\": %s}",myId.c_str());
+					appendf(out, "{\"jsonrpc\": \"2.0\", \"result\": \"success\", \"id\": %s}",myId.c_str());
 				} else {
-					mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: need uuid parameter\"}, \"id\": %s}",myId.c_str());
+					appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: need uuid parameter\"}, \"id\": %s}",myId.c_str());
 				}
 			} else {
-				mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: need uuid parameter\"}, \"id\": %s}",myId.c_str());
+				appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: need uuid parameter\"}, \"id\": %s}",myId.c_str());
 			}
 		} else if (method == "getevent") {
-			if (params.isObject()) {
-				Json::Value content = params["uuid"];
-				if (content.isString()) {
-					Variant::Map event;
+			if (params.getType() == VAR_MAP) {
+				const Variant &content = getMember(params.asMap(), "uuid");
+				if (content.getType() == VAR_STRING) {
+					// block until an event is queued for the subscription or the timeout (seconds) expires
+					unsigned int timeout = GETEVENT_TIMEOUT;
+					const Variant &timeoutValue = getMember(params.asMap(), "timeout");
+					if (!timeoutValue.isVoid()) timeout = atoi(timeoutValue.asString().c_str());
+					if (timeout > GETEVENT_MAXTIMEOUT) timeout = GETEVENT_MAXTIMEOUT;
+
+					SharedEvent event;
+					int result = EVENT_REMOVED;
 					pthread_mutex_lock(&mutexSubscriptions);	
-					map<string,Subscriber>::iterator it = subscriptions.find(content.asString());
-					while ((it != subscriptions.end()) && (it->second.queue.size() <1)) {
-						pthread_mutex_unlock(&mutexSubscriptions);	
-						usleep(200000);
-						pthread_mutex_lock(&mutexSubscriptions);	
-						// we need to search again, subscription might have been deleted during lock release
-						it = subscriptions.find(content.asString());
-					}
+					map<string,Subscriber*>::iterator it = subscriptions.find(content.asString());
 					if (it != subscriptions.end()) {
-						event = it->second.queue.front();
-						it->second.queue.pop_front();
-						pthread_mutex_unlock(&mutexSubscriptions);	
-						mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"result\": ");
-						mg_printmap(conn, event);
-						mg_printf(conn, ", \"id\": %s}",myId.c_str());
+						Subscriber *subscriber = it->second;
+						acquireSubscriber(subscriber);
+						result = waitForEvent(subscriber, event, timeout);
+						releaseSubscriber(subscriber);
+					}
+					pthread_mutex_unlock(&mutexSubscriptions);	
+					if (result == EVENT_READY) {
+						out += "{\"jsonrpc\": \"2.0\", \"result\": " + *event + ", \"id\": " + myId + "}";
+					} else if (result == EVENT_WAIT) {
+						appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32001,\"message\":\"No event within timeout\"}, \"id\": %s}",myId.c_str());
 					} else {
-						pthread_mutex_unlock(&mutexSubscriptions);	
-						mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: no current subscription for uuid\"}, \"id\": %s}",myId.c_str());
+						appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: no current subscription for uuid\"}, \"id\": %s}",myId.c_str());
 					}
 				} else {
-					mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: need uuid parameter\"}, \"id\": %s}",myId.c_str());
+					appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: need uuid parameter\"}, \"id\": %s}",myId.c_str());
 				}
 			} else {
-				mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: need uuid parameter\"}, \"id\": %s}",myId.c_str());
+				appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32602,\"message\":\"Invalid params: need uuid parameter\"}, \"id\": %s}",myId.c_str());
 			}
 
 		} else {
-			mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32601,\"message\":\"Method not found\"}, \"id\": %s}",myId.c_str());
+			appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32601,\"message\":\"Method not found\"}, \"id\": %s}",myId.c_str());
 		}
 	} else {
-		mg_printf(conn, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32600,\"message\":\"Invalid Request\"}, \"id\": %s}",myId.c_str());
+		appendf(out, "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32600,\"message\":\"Invalid Request\"}, \"id\": %s}",myId.c_str());
 	}
-	return result;
+}
+
+// the inventory as plain JSON with an ETag, answered with 304 while the client's copy is current
+static void inventory (struct mg_connection *conn, const struct mg_request_info *request_info) {
+	boost::shared_ptr<const string> json;
+	string etag;
+	if (!getInventoryJSON(json, etag)) {
+		mg_printf(conn, "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n\r\n");
+		return;
+	}
+	const char *ifNoneMatch = mg_get_header(conn, "If-None-Match");
+	if (ifNoneMatch != NULL && (etag == ifNoneMatch || strstr(ifNoneMatch, etag.c_str()) != NULL)) {
+		mg_printf(conn, "HTTP/1.1 304 Not Modified\r\nETag: %s\r\nCache-Control: no-cache\r\n\r\n", etag.c_str());
+		return;
+	}
+	sendReply(conn, "application/json; charset=utf-8", *json, "ETag: " + etag + "\r\nCache-Control: no-cache\r\n");
+}
+
+// answer a request whose body we don't read and close the connection, mongoose would otherwise parse the
+// unread body as the next request
+static void rejectRequest(struct mg_connection *conn, const char *status) {
+	mg_set_must_close(conn);
+	mg_printf(conn, "HTTP/1.1 %s\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", status);
+}
+
+// read a request body of Content-Length bytes into body, allocated once. replies with an http error and
+// returns false when the length is missing or exceeds maxRequestSize, or when the client goes away.
+static bool readRequestBody(struct mg_connection *conn, vector<char> &body) {
+	const char *contentLength = mg_get_header(conn, "Content-Length");
+	if (contentLength == NULL) {
+		rejectRequest(conn, "411 Length Required");
+		return false;
+	}
+	char *end = NULL;
+	unsigned long long length = strtoull(contentLength, &end, 10);
+	if (!isdigit((unsigned char)contentLength[0]) || *end != '\0') {
+		rejectRequest(conn, "400 Bad Request");
+		return false;
+	}
+	if (length > maxRequestSize) {
+		rejectRequest(conn, "413 Request Entity Too Large");
+		return false;
+	}
+	body.resize(length);
+	for (size_t done = 0; done < length; ) {
+		int len = mg_read(conn, &body[done], length - done);
+		if (len <= 0) {
+			printf("WARNING, request body ended after %lu of %llu bytes\n", (unsigned long)done, length);
+			return false;
+		}
+		done += len;
+	}
+	return true;
 }
 
 static void jsonrpc (struct mg_connection *conn, const struct mg_request_info *request_info) {
-	Json::Value root;
-	Json::Reader reader;
-	char post_data[65535];
-	int post_data_len;
-
-	post_data_len = mg_read(conn, post_data, sizeof(post_data));
-	mg_printf(conn, "%s", ajax_reply_start);		
-	if ( reader.parse(post_data, post_data + post_data_len, root, false) ) {
-		if (root.isArray()) {
+	Variant root;
+	vector<char> body;
+
+	if (!readRequestBody(conn, body)) return;
+	string reply;
+	// parsed straight from the body buffer
+	if (jsonBufferToVariant(body.empty() ? NULL : &body[0], body.size(), root)) {
+		if (root.getType() == VAR_LIST) {
+			// message calls of a batch are all sent before their replies are collected, at most
+			// batchConcurrency at a time, and nobody waits for replies past the batch deadline
+			const Variant::List &batch = root.asList();
+			vector<string> results(batch.size());
+			vector<PendingCall> calls(batch.size());
+			uint64_t deadline = nowMilliseconds() + (uint64_t)batchTimeout * 1000;
+			size_t collected = 0;
+			int inFlight = 0;
+			size_t i = 0;
+			for (Variant::List::const_iterator it = batch.begin(); it != batch.end(); it++, i++) {
+				for (; inFlight >= batchConcurrency; collected++) {
+					if (calls[collected].correlationId.empty()) continue;
+					collectReply(calls[collected], deadline, results[collected]);
+					inFlight--;
+				}
+				jsonrpcRequestHandler(it->getType() == VAR_MAP ? it->asMap() : Variant::Map(), results[i], &calls[i]);
+				if (!calls[i].correlationId.empty()) inFlight++;
+			}
+			for (; collected < calls.size(); collected++) {
+				if (!calls[collected].correlationId.empty()) collectReply(calls[collected], deadline, results[collected]);
+			}
+
+			reply = "[";
 			bool firstElem = true;
-			mg_printf(conn, "[");
-			for (unsigned int i = 0; i< root.size(); i++) {
-				bool result = jsonrpcRequestHandler(conn, root[i], firstElem);
-				if (result) firstElem = false; 
+			for (i = 0; i < results.size(); i++) {
+				if (results[i].empty()) continue;
+				if (!firstElem) reply += ",";
+				reply += results[i];
+				firstElem = false; 
 			}
-			mg_printf(conn, "]");
+			reply += "]";
+		} else if (root.getType() == VAR_MAP) {
+			jsonrpcRequestHandler(root.asMap(), reply);
 		} else {
-			jsonrpcRequestHandler(conn, root, true);
+			reply = "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32600,\"message\":\"Invalid Request\"}, \"id\": null}";
 		}
 	} else {
-		mg_printf(conn, "%s", "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32700,\"message\":\"Parse error\"}, \"id\": null}");
+		reply = "{\"jsonrpc\": \"2.0\", \"error\": {\"code\":-32700,\"message\":\"Parse error\"}, \"id\": null}";
 	}
+	sendReply(conn, "application/x-javascript; charset=utf-8", reply);
 }
 
 
@@ -403,6 +847,8 @@ static void *event_handler(enum mg_event event,
       jsonrpc(conn, request_info);
     } else if (strcmp(request_info->uri, "/update") == 0) {
       update(conn, request_info);
+    } else if (strcmp(request_info->uri, "/inventory") == 0) {
+      inventory(conn, request_info);
     } else {
       // No suitable handler found, mark as not processed. Mongoose will
       // try to serve the request.
@@ -419,7 +865,7 @@ static void *event_handler(enum mg_event event,
 }
 
 
-
+#ifndef RPC_BENCH
 int main(int argc, char **argv) {
 	string broker;
 	string port; 
@@ -438,6 +884,18 @@ int main(int argc, char **argv) {
 	certificate=getConfigOption("rpc", "certificate", CONFDIR "/rpc/rpc_cert.pem");
 	numthreads=getConfigOption("rpc", "numthreads", "30");
 	domainname=getConfigOption("rpc", "domainname", "agocontrol");
+	validateCommands = atoi(getConfigOption("rpc", "validatecommands", "0").c_str()) == 1;
+	compressReplies = atoi(getConfigOption("rpc", "compress", "1").c_str()) == 1;
+	batchConcurrency = atoi(getConfigOption("rpc", "batchconcurrency", "8").c_str());
+	if (batchConcurrency < 1) batchConcurrency = 1;
+	batchTimeout = atoi(getConfigOption("rpc", "batchtimeout", "10").c_str());
+	inventoryMaxAge = atoi(getConfigOption("rpc", "inventorycache", "60").c_str());
+	maxRequestSize = strtoul(getConfigOption("rpc", "maxrequestsize", "4194304").c_str(), NULL, 10);
+	int sessions = atoi(getConfigOption("rpc", "sessions", "4").c_str());
+	if (sessions < 1) sessions = 1;
+	int eventBufferSize = atoi(getConfigOption("rpc", "eventbuffer", "1000").c_str());
+	if (eventBufferSize < 1) eventBufferSize = 1;
+	eventRing.resize(eventBufferSize);
 
 	useSSL = port.find('s') != std::string::npos;
 
@@ -451,11 +909,9 @@ int main(int argc, char **argv) {
 	};
 
 	pthread_mutex_init(&mutexSubscriptions, NULL);
-
-	// start web server
-	if((ctx = mg_start(&event_handler, NULL, options)) == NULL) {
-		printf("Cannot start http server\n");
-	}
+	pthread_cond_init(&eventCond, NULL);
+	pthread_mutex_init(&mutexSchema, NULL);
+	pthread_mutex_init(&mutexInventory, NULL);
 
 	connectionOptions["reconnect"] = "true";
 
@@ -464,16 +920,49 @@ int main(int argc, char **argv) {
 		connection->open(); 
 		session = connection->createSession(); 
 		receiver = session.createReceiver("agocontrol; {create: always, node: {type: topic}}"); 
-		sender = session.createSender("agocontrol; {create: always, node: {type: topic}}"); 
 	} catch(const std::exception& error) {
 		std::cerr << error.what() << std::endl;
 		connection->close();
 		printf("could not startup\n");
 		return 1;
 	}
+	if (!createBridge(sessions)) {
+		connection->close();
+		printf("could not startup\n");
+		return 1;
+	}
+
+	if (validateCommands) {
+		pthread_t schemaThread;
+		if (pthread_create(&schemaThread, NULL, schemaSyncer, NULL) == 0) {
+			pthread_detach(schemaThread);
+		} else {
+			printf("could not start schema thread, commands are not validated\n");
+			validateCommands = false;
+		}
+	}
 
+	// start web server, the handlers need the bridge
+	if((ctx = mg_start(&event_handler, NULL, options)) == NULL) {
+		printf("Cannot start http server\n");
+	}
 
+	time_t lastSubscriptionCheck = time(NULL);
 	while (true) {
+		if (time(NULL) - lastSubscriptionCheck >= 60) {
+			// clients which stopped polling without unsubscribing
+			lastSubscriptionCheck = time(NULL);
+			pthread_mutex_lock(&mutexSubscriptions);	
+			for (map<string,Subscriber*>::iterator it = subscriptions.begin(); it != subscriptions.end(); ) {
+				if (it->second->users == 0 && lastSubscriptionCheck - it->second->lastAccess > SUBSCRIPTION_TIMEOUT) {
+					printf("removing abandoned subscription %s\n", it->first.c_str());
+					removeSubscriber(it++);
+				} else {
+					++it;
+				}
+			}
+			pthread_mutex_unlock(&mutexSubscriptions);	
+		}
 		try{
 			Variant::Map content;
 			string subject;
@@ -494,6 +983,8 @@ int main(int argc, char **argv) {
 				}
 
 				decode(message, content);
+				if (validateCommands) trackDeviceTypes(subject, content);
+				if (changesInventory(subject)) invalidateInventory();
 				content["event"] = subject;
 				if ((subject.find("event.environment.") != std::string::npos) && (subject.find("changed")!= std::string::npos)) {
 					string quantity = subject;
@@ -501,18 +992,12 @@ int main(int argc, char **argv) {
 					quantity.erase(quantity.end()-7,quantity.end());	
 					content["quantity"] = quantity;
 				}
+				// serialized once outside the lock, all subscribers share the same string
+				string *json = new string();
+				variantMapToJSON(content, *json);
+				SharedEvent event(json);
 				pthread_mutex_lock(&mutexSubscriptions);	
-				for (map<string,Subscriber>::iterator it = subscriptions.begin(); it != subscriptions.end(); ) {
-					if (it->second.queue.size() > 100) {
-						// this subscription seems to be abandoned, let's remove it to save resources
-						printf("removing subscription %s as the queue size exceeds limits\n", it->first.c_str());
-						Subscriber *sub = &(it->second);
-						subscriptions.erase(it++);
-					} else {
-						it->second.queue.push_back(content);
-						++it;
-					}
-				}
+				publishEvent(event);
 				pthread_mutex_unlock(&mutexSubscriptions);	
 			}	
 
@@ -525,3 +1010,131 @@ int main(int argc, char **argv) {
 	}
 
 }
+#else
+// g++ -DRPC_BENCH -I. -I../../shared agorpc.cpp mongoose.c ../../shared/agoclient.cpp ../../shared/CDataFile.cpp -lqpidmessaging -lqpidtypes -luuid -ljsoncpp -lpthread -ldl -lz
+// renders the inventory reply of a 2000 device inventory with the former mg_printmap token writes, each one
+// an mg_printf, into a counting sink and with variantMapToJSON and buildReply as sendReply does
+
+// what mg_printf did per token: format into a buffer and write it to the socket
+struct CountingSink {
+	unsigned long writes;
+	unsigned long bytes;
+};
+
+static void sinkPrintf(CountingSink &sink, const char *format, ...) {
+	char buffer[8192];
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(buffer, sizeof(buffer), format, args);
+	va_end(args);
+	sink.writes++;
+	if (len > 0) sink.bytes += len;
+}
+
+static void legacyPrintMap(CountingSink &sink, Variant::Map map);
+
+static void legacyPrintList(CountingSink &sink, Variant::List list) {
+	sinkPrintf(sink, "[");
+	for (Variant::List::const_iterator it = list.begin(); it != list.end(); ++it) {
+		switch(it->getType()) {
+			case VAR_MAP: legacyPrintMap(sink, it->asMap()); break;
+			case VAR_STRING: sinkPrintf(sink, "\"%s\"", it->asString().c_str()); break;
+			default:
+				if (it->asString().size() != 0) sinkPrintf(sink, "%s", it->asString().c_str());
+				else sinkPrintf(sink, "null");
+		}
+		Variant::List::const_iterator following = it;
+		if (++following != list.end()) sinkPrintf(sink, ",");
+	}
+	sinkPrintf(sink, "]");
+}
+
+static void legacyPrintMap(CountingSink &sink, Variant::Map map) {
+	sinkPrintf(sink, "{");
+	for (Variant::Map::const_iterator it = map.begin(); it != map.end(); ++it) {
+		sinkPrintf(sink, "\"%s\":", it->first.c_str());
+		switch (it->second.getType()) {
+			case VAR_MAP: legacyPrintMap(sink, it->second.asMap()); break;
+			case VAR_LIST: legacyPrintList(sink, it->second.asList()); break;
+			case VAR_STRING: sinkPrintf(sink, "\"%s\"", it->second.asString().c_str()); break;
+			default:
+				if (it->second.asString().size() != 0) sinkPrintf(sink, "%s", it->second.asString().c_str());
+				else sinkPrintf(sink, "null");
+		}
+		Variant::Map::const_iterator following = it;
+		if (++following != map.end()) sinkPrintf(sink, ",");
+	}
+	sinkPrintf(sink, "}");
+}
+
+static double elapsed(const struct timeval &start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0;
+}
+
+int main(int argc, char **argv) {
+	Variant::Map devices;
+	for (int i = 0; i < 2000; i++) {
+		Variant::Map device, values, temperature;
+		temperature["level"] = 21.5 + i % 10;
+		temperature["unit"] = "degC";
+		temperature["timestamp"] = int2str(1380000000 + i);
+		values["temperature"] = temperature;
+		device["devicetype"] = "multilevelsensor";
+		device["internalid"] = int2str(i) + "/1";
+		device["handled-by"] = "zwave";
+		device["name"] = "sensor " + int2str(i);
+		device["room"] = generateUuid();
+		device["state"] = "0";
+		device["values"] = values;
+		devices[generateUuid()] = device;
+	}
+	Variant::Map inventory;
+	inventory["devices"] = devices;
+	inventory["rooms"] = Variant::Map();
+	inventory["variables"] = Variant::Map();
+
+	const int rounds = argc > 1 ? atoi(argv[1]) : 20;
+	struct timeval start;
+
+	// former reply: header, then the inventory token by token
+	CountingSink sink = { 0, 0 };
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < rounds; i++) {
+		sinkPrintf(sink, "%s", "HTTP/1.1 200 OK\r\nContent-Type: application/json\r\n\r\n");
+		sinkPrintf(sink, "{\"jsonrpc\": \"2.0\", \"result\": ");
+		legacyPrintMap(sink, inventory);
+		sinkPrintf(sink, ", \"id\": 1}");
+	}
+	double legacy = elapsed(start) / rounds;
+
+	size_t identitySize = 0, gzipSize = 0;
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < rounds; i++) {
+		string body = "{\"jsonrpc\": \"2.0\", \"result\": ";
+		variantMapToJSON(inventory, body);
+		body += ", \"id\": 1}";
+		string reply;
+		buildReply(reply, NULL, "application/json", body, "");
+		identitySize = reply.size();
+	}
+	double identity = elapsed(start) / rounds;
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < rounds; i++) {
+		string body = "{\"jsonrpc\": \"2.0\", \"result\": ";
+		variantMapToJSON(inventory, body);
+		body += ", \"id\": 1}";
+		string reply;
+		buildReply(reply, "gzip", "application/json", body, "");
+		gzipSize = reply.size();
+	}
+	double gzip = elapsed(start) / rounds;
+
+	std::cout << "mg_printmap: " << legacy << " ms, " << sink.writes / rounds << " writes, " << sink.bytes / rounds << " bytes" << std::endl;
+	std::cout << "sendReply:   " << identity << " ms, 1 write, " << identitySize << " bytes" << std::endl;
+	std::cout << "gzip:        " << gzip << " ms, 1 write, " << gzipSize << " bytes" << std::endl;
+	return 0;
+}
+#endif
@@ -342,6 +342,26 @@ if (sessionStorage.supported_devices) {
 var securityPromted = false;
 
 function handleEvent(response) {
+    if (response.error) {
+        if (response.error.code == -32001) {
+            // long poll timed out without an event, just ask again
+            getEvent();
+        } else {
+            // subscription is gone, e.g. the server was restarted
+            setTimeout(subscribe, 1000);
+        }
+        return;
+    }
+    processEvent(response);
+    getEvent();
+}
+
+function processEvent(response) {
+    if (response.result.event == "event.rpc.eventslost") {
+        // we fell behind the server's event buffer, start over from a fresh inventory
+        getInventory();
+        return;
+    }
     if (response.result.event == "event.security.countdown" && !securityPromted) {
         securityPromted = true;
         var pin = window.prompt("Alarm please entry pin:");
@@ -408,7 +428,6 @@ function handleEvent(response) {
             break;
         }
     }
-    getEvent();
 }
 
 function getEvent() {
@@ -614,9 +633,23 @@ window.onpopstate = function(event) {
 
 function getInventory(customCb) {
     var cb = customCb || handleInventory;
-    var content = {};
-    content.command = "inventory";
-    sendCommand(content, cb);
+    // the browser revalidates its copy with the ETag, unchanged inventories come back as 304
+    $.ajax({
+	type : 'GET',
+	url : "/inventory",
+	success : function(inventory) {
+	    cb({
+		result : inventory
+	    });
+	},
+	error : function() {
+	    var content = {};
+	    content.command = "inventory";
+	    sendCommand(content, cb);
+	},
+	dataType : "json",
+	async : true
+    });
 }
 
 function unsubscribe() {
@@ -667,7 +700,28 @@ function sendCommand(content, callback, timeout) {
     });
 }
 
+/**
+ * Receives all events over a single Server-Sent Events stream,
+ * the browser reconnects by itself if it drops
+ */
+function streamEvents() {
+    var source = new EventSource("/update");
+    source.onopen = function() {
+	// events may have been missed while we were not connected
+	getInventory();
+    };
+    source.onmessage = function(message) {
+	processEvent({
+	    result : JSON.parse(message.data)
+	});
+    };
+}
+
 function subscribe() {
+    if (window.EventSource) {
+	streamEvents();
+	return;
+    }
     var request = {};
     request.method = "subscribe";
     request.id = 1;
@@ -658,6 +658,10 @@ struct mg_request_info *mg_get_request_info(struct mg_connection *conn) {
   return &conn->request_info;
 }
 
+void mg_set_must_close(struct mg_connection *conn) {
+  conn->must_close = 1;
+}
+
 static void mg_strlcpy(register char *dst, register const char *src, size_t n) {
   for (; *src != '\0' && n > 1; n--) {
     *dst++ = *src++;
@@ -227,6 +227,13 @@ int mg_modify_passwords_file(const char *passwords_file_name,
 struct mg_request_info *mg_get_request_info(struct mg_connection *);
 
 
+// Close the connection after the current request, regardless of keep-alive.
+//
+// Use it when the request body is left unread, it would otherwise be parsed
+// as the next request.
+void mg_set_must_close(struct mg_connection *);
+
+
 // Send data to the client.
 // Return:
 //  0   when the connection has been closed
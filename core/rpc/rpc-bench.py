@@ -0,0 +1,32 @@
+#!/usr/bin/env python
+# measure /jsonrpc inventory latency of a running agorpc
+# usage: python rpc-bench.py [url] [rounds]
+# run it against the old and the new build with the same inventory to compare them
+import sys
+import time
+import urllib2
+
+url = 'http://localhost:8008/jsonrpc'
+rounds = 50
+if len(sys.argv) > 1:
+    url = sys.argv[1]
+if len(sys.argv) > 2:
+    rounds = int(sys.argv[2])
+
+request = '{"method":"message","params":{"content":{"command":"inventory"}},"id":1,"jsonrpc":"2.0"}'
+
+def bench(headers):
+    times = []
+    size = 0
+    for i in range(rounds):
+        req = urllib2.Request(url, request, headers)
+        start = time.time()
+        response = urllib2.urlopen(req)
+        size = len(response.read())
+        times.append((time.time() - start) * 1000.0)
+    times.sort()
+    return size, times
+
+for name, headers in [('identity', {}), ('gzip', {'Accept-Encoding': 'gzip'})]:
+    size, times = bench(headers)
+    print "%-8s %8d bytes  min %7.1f ms  median %7.1f ms  avg %7.1f ms  max %7.1f ms" % (name, size, times[0], times[len(times) / 2], sum(times) / len(times), times[-1])
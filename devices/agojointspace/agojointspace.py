@@ -479,7 +479,7 @@ while True:
 						# send ACK to acknowledge message reception if asked for
 						if message.reply_to:
 							replysender = session.sender(message.reply_to)
-							response = Message("ACK")
+							response = Message("ACK", correlation_id=message.correlation_id)
 							try:
 								replysender.send(response)
 							except SendError, e:
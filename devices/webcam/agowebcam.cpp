@@ -54,6 +54,8 @@ CURLcode curl_read(const std::string& url, std::ostream& os, long timeout = 30)
 		&& CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L))
 		&& CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_FILE, &os))
 		&& CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout))
+		// the timeout must not use signals, commands are handled on several worker threads
+		&& CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L))
 		&& CURLE_OK == (code = curl_easy_setopt(curl, CURLOPT_URL, url.c_str())))
 		{
 			code = curl_easy_perform(curl);
@@ -89,6 +91,8 @@ int main(int argc, char **argv) {
 	agoConnection = &_agoConnection;
 
 	agoConnection->addHandler(commandHandler);
+	// frame grabs can take seconds, don't let one slow camera block the others
+	agoConnection->setWorkerPool(true);
 
 	stringstream devices(getConfigOption("webcam", "devices", "http://192.168.80.65/axis-cgi/jpg/image.cgi"));
 	string device;
@@ -45,7 +45,10 @@
 #include <limits.h>
 #include <stdarg.h>
 #include <fstream>
+#include <sstream>
 #include <float.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #ifdef WIN32
 #include <windows.h>
@@ -70,6 +73,7 @@ CDataFile::CDataFile(t_Str szFileName)
 	m_szFileName = szFileName;
 	m_Flags = (AUTOCREATE_SECTIONS | AUTOCREATE_KEYS);
 	m_Sections.push_back( *(new t_Section) );
+	RebuildIndex();
 
 	Load(m_szFileName);
 }
@@ -79,6 +83,7 @@ CDataFile::CDataFile()
 	Clear();
 	m_Flags = (AUTOCREATE_SECTIONS | AUTOCREATE_KEYS);
 	m_Sections.push_back( *(new t_Section) );
+	RebuildIndex();
 }
 
 // ~CDataFile
@@ -97,6 +102,7 @@ void CDataFile::Clear()
 	m_bDirty = false;
 	m_szFileName = t_Str("");
 	m_Sections.clear();
+	m_SectionIndex.clear();
 }
 
 // SetFileName
@@ -118,7 +124,10 @@ void CDataFile::SetFileName(t_Str szFileName)
 // Load
 // Attempts to load in the text file. If successful it will populate the 
 // Section list with the key/value pairs found in the file. Note that comments
-// are saved so that they can be rewritten to the file later.
+// are saved so that they can be rewritten to the file later. The raw text of
+// each section is kept as well, so Save can write untouched sections back
+// exactly as they were. Comment and blank lines directly preceding a section
+// header belong to that section's text.
 bool CDataFile::Load(t_Str szFileName)
 {
 	// We dont want to create a new file here.  If it doesn't exist, just
@@ -133,8 +142,12 @@ bool CDataFile::Load(t_Str szFileName)
 		
 		t_Str szLine;
 		t_Str szComment;
+		t_Str szRawLine;
+		t_Str szPending;
+		IndexMap Repeated;
 		char buffer[MAX_BUFFER_LEN]; 
 		t_Section* pSection = GetSection("");
+		t_Str szCurrent = pSection->szName;
 
 		// These need to be set, we'll restore the original values later.
 		m_Flags |= AUTOCREATE_KEYS;
@@ -150,10 +163,15 @@ bool CDataFile::Load(t_Str szFileName)
 
 			bDone = ( File.eof() || File.bad() || File.fail() );
 
+			szRawLine = buffer;
+			if ( !File.eof() || szRawLine.size() > 0 )
+				szRawLine += "\n";
+
 			if ( szLine.find_first_of(CommentIndicators) == 0 )
 			{
 				szComment += "\n";
 				szComment += szLine;
+				szPending += szRawLine;
 			}
 			else
 			if ( szLine.find_first_of('[') == 0 ) // new section
@@ -161,9 +179,17 @@ bool CDataFile::Load(t_Str szFileName)
 				szLine.erase( 0, 1 );
 				szLine.erase( szLine.find_last_of(']'), 1 );
 
-				CreateSection(szLine, szComment);
+				bool bCreated = CreateSection(szLine, szComment);
 				pSection = GetSection(szLine);
+				szCurrent = pSection->szName;
 				szComment = t_Str("");
+
+				// a repeated section header can't be written back verbatim
+				if ( bCreated )
+					pSection->szRaw = szPending + szRawLine;
+				else
+					Repeated[LowerCase(szCurrent)] = 1;
+				szPending = t_Str("");
 			}
 			else 
 			if ( szLine.size() > 0 ) // we have a key, add this key/value pair
@@ -173,11 +199,32 @@ bool CDataFile::Load(t_Str szFileName)
 
 				if ( szKey.size() > 0 && szValue.size() > 0 )
 				{
-					SetValue(szKey, szValue, szComment, pSection->szName);
+					SetValue(szKey, szValue, szComment, szCurrent);
+					pSection = GetSection(szCurrent);
 					szComment = t_Str("");
 				}
+				pSection->szRaw += szPending + szRawLine;
+				szPending = t_Str("");
+			}
+			else
+			{
+				szPending += szRawLine;
+			}
+		}
+
+		pSection->szRaw += szPending;
+		pSection->szTrailer = szPending;
+
+		// everything loaded so far matches the file on disk
+		for (SectionItor s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		{
+			if ( (*s_pos).bDirty && Repeated.find(LowerCase((*s_pos).szName)) == Repeated.end() )
+			{
+				(*s_pos).bRaw = true;
+				(*s_pos).bDirty = false;
 			}
 		}
+		m_bDirty = false;
 
 		// Restore the original flag values.
 		if ( !bAutoKey )
@@ -201,10 +248,13 @@ bool CDataFile::Load(t_Str szFileName)
 // Save
 // Attempts to save the Section list and keys to the file. Note that if Load
 // was never called (the CDataFile object was created manually), then you
-// must set the m_szFileName variable before calling save.
+// must set the m_szFileName variable before calling save. Nothing is written
+// when no data changed since loading or the last save.
 bool CDataFile::Save()
 {
-	return true; //TODO: FIX this broken piece of software (CDatafile)
+	if ( !m_bDirty )
+		return true;
+
 	if ( KeyCount() == 0 && SectionCount() == 0 )
 	{
 		// no point in saving
@@ -218,40 +268,63 @@ bool CDataFile::Save()
 		return false;
 	}
 
-	fstream File(m_szFileName.c_str(), ios::out|ios::trunc);
+	// write to a temporary file next to the target and rename it over the
+	// original, so readers never see a partially written file. mkstemp gives
+	// every writer its own name, the new file gets the mode of the old one
+	std::vector<char> Template(m_szFileName.begin(), m_szFileName.end());
+	const char Suffix[] = ".XXXXXX";
+	Template.insert(Template.end(), Suffix, Suffix + sizeof(Suffix));
+	int fd = mkstemp(&Template[0]);
+	if ( fd == -1 )
+	{
+		Report(E_ERROR, "[CDataFile::Save %s] Unable to save file.", m_szFileName.c_str());
+		return false;
+	}
+	t_Str szTempName = &Template[0];
+	struct stat st;
+	fchmod(fd, stat(m_szFileName.c_str(), &st) == 0 ? st.st_mode & 07777 : 0644);
+	close(fd);
+	fstream File(szTempName.c_str(), ios::out|ios::trunc);
+
+	// sections that were not modified since loading are copied verbatim,
+	// only dirty ones are regenerated from the parsed keys
+	std::vector<t_Str> Generated(m_Sections.size());
 
 	if ( File.is_open() )
 	{
-		SectionItor s_pos;
-		KeyItor k_pos;
-		t_Section Section;
-		t_Key Key;
-
-		for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+		for (size_t i = 0; i < m_Sections.size(); i++)
 		{
-			Section = (*s_pos);
+			t_Section& Section = m_Sections[i];
+
+			if ( Section.bRaw && !Section.bDirty )
+			{
+				File << Section.szRaw;
+				continue;
+			}
+
+			std::ostringstream Text;
 			bool bWroteComment = false;
 
 			if ( Section.szComment.size() > 0 )
 			{
 				bWroteComment = true;
-				WriteLn(File, "\n%s", CommentStr(Section.szComment).c_str());
+				WriteLn(Text, "\n%s", CommentStr(Section.szComment).c_str());
 			}
 
 			if ( Section.szName.size() > 0 )
 			{
-				WriteLn(File, "%s[%s]", 
+				WriteLn(Text, "%s[%s]", 
 						bWroteComment ? "" : "\n", 
 						Section.szName.c_str());
 			}
 
-			for (k_pos = Section.Keys.begin(); k_pos != Section.Keys.end(); k_pos++)
+			for (KeyItor k_pos = Section.Keys.begin(); k_pos != Section.Keys.end(); k_pos++)
 			{
-				Key = (*k_pos);
+				const t_Key& Key = (*k_pos);
 
 				if ( Key.szKey.size() > 0 && Key.szValue.size() > 0 )
 				{
-					WriteLn(File, "%s%s%s%s%c%s", 
+					WriteLn(Text, "%s%s%s%s%c%s", 
 						Key.szComment.size() > 0 ? "\n" : "",
 						CommentStr(Key.szComment).c_str(),
 						Key.szComment.size() > 0 ? "\n" : "",
@@ -260,20 +333,44 @@ bool CDataFile::Save()
 						Key.szValue.c_str());
 				}
 			}
+
+			Text << Section.szTrailer;
+			Generated[i] = Text.str();
+			File << Generated[i];
 		}
 		
 	}
 	else
 	{
 		Report(E_ERROR, "[CDataFile::Save %s] Unable to save file.", m_szFileName.c_str());
+		unlink(szTempName.c_str());
 		return false;
 	}
 
-	m_bDirty = false;
-	
 	File.flush();
+	bool bFailed = File.fail();
 	File.close();
 
+	if ( bFailed || rename(szTempName.c_str(), m_szFileName.c_str()) != 0 )
+	{
+		Report(E_ERROR, "[CDataFile::Save %s] Unable to replace file.", m_szFileName.c_str());
+		unlink(szTempName.c_str());
+		return false;
+	}
+
+	// what we just wrote is now the on-disk text of every section
+	for (size_t i = 0; i < m_Sections.size(); i++)
+	{
+		if ( !m_Sections[i].bRaw || m_Sections[i].bDirty )
+		{
+			m_Sections[i].szRaw = Generated[i];
+			m_Sections[i].bRaw = true;
+			m_Sections[i].bDirty = false;
+		}
+	}
+
+	m_bDirty = false;
+
 	return true;
 }
 
@@ -281,24 +378,16 @@ bool CDataFile::Save()
 // Set the comment of a given key. Returns true if the key is not found.
 bool CDataFile::SetKeyComment(t_Str szKey, t_Str szComment, t_Str szSection)
 {
-	KeyItor k_pos;
-	t_Section* pSection;
+	t_Key* pKey = GetKey(szKey, szSection);
 
-	if ( (pSection = GetSection(szSection)) == NULL )
+	if ( pKey == NULL )
 		return false;
 
-	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
-	{
-		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
-		{
-			(*k_pos).szComment = szComment;
-			m_bDirty = true;
-			return true;
-		}
-	}
-
-	return false;
+	pKey->szComment = szComment;
+	GetSection(szSection)->bDirty = true;
+	m_bDirty = true;
 
+	return true;
 }
 
 // SetSectionComment
@@ -306,19 +395,16 @@ bool CDataFile::SetKeyComment(t_Str szKey, t_Str szComment, t_Str szSection)
 // was not found.
 bool CDataFile::SetSectionComment(t_Str szSection, t_Str szComment)
 {
-	SectionItor s_pos;
+	t_Section* pSection = GetSection(szSection);
 
-	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
-	{
-		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 ) 
-		{
-		    (*s_pos).szComment = szComment;
-			m_bDirty = true;
-			return true;
-		}
-	}
+	if ( pSection == NULL )
+		return false;
 
-	return false;
+	pSection->szComment = szComment;
+	pSection->bDirty = true;
+	m_bDirty = true;
+
+	return true;
 }
 
 
@@ -355,8 +441,11 @@ bool CDataFile::SetValue(t_Str szKey, t_Str szValue, t_Str szComment, t_Str szSe
 		pKey->szComment = szComment;
 		
 		m_bDirty = true;
+		pSection->bDirty = true;
 		
+		pSection->KeyIndex[LowerCase(szKey)] = pSection->Keys.size();
 		pSection->Keys.push_back(*pKey);
+		delete pKey;
 
 		return true;
 	}
@@ -364,9 +453,12 @@ bool CDataFile::SetValue(t_Str szKey, t_Str szValue, t_Str szComment, t_Str szSe
 	if ( pKey != NULL )
 	{
 		pKey->szValue = szValue;
-		pKey->szComment = szComment;
+		// keep the existing comment unless a new one was given
+		if ( szComment.size() > 0 )
+			pKey->szComment = szComment;
 
 		m_bDirty = true;
+		pSection->bDirty = true;
 		
 		return true;
 	}
@@ -473,18 +565,16 @@ bool CDataFile::GetBool(t_Str szKey, t_Str szSection)
 // found or true when sucessfully deleted.
 bool CDataFile::DeleteSection(t_Str szSection)
 {
-	SectionItor s_pos;
+	IndexMap::iterator it = m_SectionIndex.find(LowerCase(szSection));
 
-	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
-	{
-		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 ) 
-		{
-			m_Sections.erase(s_pos);
-			return true;
-		}
-	}
+	if ( it == m_SectionIndex.end() )
+		return false;
 
-	return false;
+	m_Sections.erase(m_Sections.begin() + it->second);
+	RebuildIndex();
+	m_bDirty = true;
+
+	return true;
 }
 
 // DeleteKey
@@ -492,22 +582,22 @@ bool CDataFile::DeleteSection(t_Str szSection)
 // cannot be found or true when sucessfully deleted.
 bool CDataFile::DeleteKey(t_Str szKey, t_Str szFromSection)
 {
-	KeyItor k_pos;
 	t_Section* pSection;
 
 	if ( (pSection = GetSection(szFromSection)) == NULL )
 		return false;
 
-	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
-	{
-		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
-		{
-			pSection->Keys.erase(k_pos);
-			return true;
-		}
-	}
+	IndexMap::iterator it = pSection->KeyIndex.find(LowerCase(szKey));
 
-	return false;
+	if ( it == pSection->KeyIndex.end() )
+		return false;
+
+	pSection->Keys.erase(pSection->Keys.begin() + it->second);
+	RebuildKeyIndex(pSection);
+	pSection->bDirty = true;
+	m_bDirty = true;
+
+	return true;
 }
 
 // CreateKey
@@ -550,7 +640,9 @@ bool CDataFile::CreateSection(t_Str szSection, t_Str szComment)
 
 	pSection->szName = szSection;
 	pSection->szComment = szComment;
+	m_SectionIndex[LowerCase(szSection)] = m_Sections.size();
 	m_Sections.push_back(*pSection);
+	delete pSection;
 	m_bDirty = true;
 
 	return true;
@@ -583,9 +675,10 @@ bool CDataFile::CreateSection(t_Str szSection, t_Str szComment, KeyList Keys)
 		pKey->szValue = (*k_pos).szValue;
 
 		pSection->Keys.push_back(*pKey);
+		delete pKey;
 	}
 
-	m_Sections.push_back(*pSection);
+	RebuildKeyIndex(pSection);
 	m_bDirty = true;
 
 	return true;
@@ -620,7 +713,6 @@ int CDataFile::KeyCount()
 // pointer to that key, otherwise returns NULL.
 t_Key*	CDataFile::GetKey(t_Str szKey, t_Str szSection)
 {
-	KeyItor k_pos;
 	t_Section* pSection;
 
 	// Since our default section has a name value of t_Str("") this should
@@ -629,13 +721,12 @@ t_Key*	CDataFile::GetKey(t_Str szKey, t_Str szSection)
 	if ( (pSection = GetSection(szSection)) == NULL )
 		return NULL;
 
-	for (k_pos = pSection->Keys.begin(); k_pos != pSection->Keys.end(); k_pos++)
-	{
-		if ( CompareNoCase( (*k_pos).szKey, szKey ) == 0 )
-			return (t_Key*)&(*k_pos);
-	}
+	IndexMap::iterator it = pSection->KeyIndex.find(LowerCase(szKey));
+
+	if ( it == pSection->KeyIndex.end() )
+		return NULL;
 
-	return NULL;
+	return &pSection->Keys[it->second];
 }
 
 // GetSection
@@ -643,15 +734,36 @@ t_Key*	CDataFile::GetKey(t_Str szKey, t_Str szSection)
 // to it. If the section was not found, returns NULL
 t_Section* CDataFile::GetSection(t_Str szSection)
 {
-	SectionItor s_pos;
+	IndexMap::iterator it = m_SectionIndex.find(LowerCase(szSection));
 
-	for (s_pos = m_Sections.begin(); s_pos != m_Sections.end(); s_pos++)
+	if ( it == m_SectionIndex.end() )
+		return NULL;
+
+	return &m_Sections[it->second];
+}
+
+// RebuildIndex
+// Recreates the name indexes after entries were removed from the middle of
+// the section list.
+void CDataFile::RebuildIndex()
+{
+	m_SectionIndex.clear();
+
+	for (size_t i = 0; i < m_Sections.size(); i++)
 	{
-		if ( CompareNoCase( (*s_pos).szName, szSection ) == 0 ) 
-			return (t_Section*)&(*s_pos);
+		m_SectionIndex[LowerCase(m_Sections[i].szName)] = i;
+		RebuildKeyIndex(&m_Sections[i]);
 	}
+}
 
-	return NULL;
+// RebuildKeyIndex
+// Recreates the key index of one section from its key list.
+void CDataFile::RebuildKeyIndex(t_Section* pSection)
+{
+	pSection->KeyIndex.clear();
+
+	for (size_t i = 0; i < pSection->Keys.size(); i++)
+		pSection->KeyIndex[LowerCase(pSection->Keys[i].szKey)] = i;
 }
 
 
@@ -718,6 +830,19 @@ int CompareNoCase(t_Str str1, t_Str str2)
 #endif
 }
 
+// LowerCase
+// Returns a lower-cased copy of the string, used as the key for the section
+// and key indexes so lookups stay case-insensitive like CompareNoCase.
+t_Str LowerCase(const t_Str& szStr)
+{
+	t_Str szLower(szStr);
+
+	for (size_t i = 0; i < szLower.size(); i++)
+		szLower[i] = tolower((unsigned char)szLower[i]);
+
+	return szLower;
+}
+
 // Trim
 // Trims whitespace from both sides of a string.
 void Trim(t_Str& szStr)
@@ -744,7 +869,7 @@ void Trim(t_Str& szStr)
 // WriteLn
 // Writes the formatted output to the file stream, returning the number of
 // bytes written.
-int WriteLn(fstream& stream, const char* fmt, ...)
+int WriteLn(ostream& stream, const char* fmt, ...)
 {
 	char buf[MAX_BUFFER_LEN];
 	int nLength;
@@ -757,6 +882,11 @@ int WriteLn(fstream& stream, const char* fmt, ...)
 	  nLength = vsnprintf(buf, MAX_BUFFER_LEN, fmt, args);
 	va_end (args);
 
+	// vsnprintf returns the untruncated length
+	if ( nLength < 0 )
+		return 0;
+	if ( nLength > MAX_BUFFER_LEN - 1 )
+		nLength = MAX_BUFFER_LEN - 1;
 
 	if ( buf[nLength] != '\n' && buf[nLength] != '\r' )
 		buf[nLength++] = '\n';
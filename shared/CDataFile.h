@@ -18,6 +18,7 @@
 #include <vector>
 #include <fstream>
 #include <string>
+#include <boost/unordered_map.hpp>
 using namespace std;
 
 // Globally defined structures, defines, & types
@@ -113,6 +114,11 @@ typedef struct st_key
 typedef std::vector<t_Key> KeyList;
 typedef KeyList::iterator KeyItor;
 
+// IndexMap
+// Maps a lower-cased section or key name to its position in the ordered
+// section or key list, so lookups don't need to scan the lists.
+typedef boost::unordered_map<t_Str, size_t> IndexMap;
+
 // st_section
 // This structure stores the definition of a section. A section contains any number
 // of keys (see st_keys), and may or may not have a comment. Like keys, all
@@ -122,12 +128,19 @@ typedef struct st_section
 	t_Str		szName;
 	t_Str		szComment;
 	KeyList		Keys;
+	IndexMap	KeyIndex;	// lower-cased key name -> position in Keys
+	t_Str		szRaw;		// the section text exactly as it was loaded
+	t_Str		szTrailer;	// comment lines after the last key at the end of the file
+	bool		bRaw;		// szRaw is valid and can be written back as is
+	bool		bDirty;		// changed since it was loaded
 
 	st_section()
 	{
 		szName = t_Str("");
 		szComment = t_Str("");
 		Keys.clear();
+		bRaw = false;
+		bDirty = true;
 	}
 
 } t_Section;
@@ -142,8 +155,9 @@ typedef SectionList::iterator SectionItor;
 void	Report(e_DebugLevel DebugLevel, const char *fmt, ...);
 t_Str	GetNextWord(t_Str& CommandLine);
 int		CompareNoCase(t_Str str1, t_Str str2);
+t_Str	LowerCase(const t_Str& szStr);
 void	Trim(t_Str& szStr);
-int		WriteLn(fstream& stream, const char* fmt, ...);
+int		WriteLn(ostream& stream, const char* fmt, ...);
 
 
 /// Class Definitions ///////////////////////////////////////////////////////////
@@ -259,6 +273,11 @@ protected:
 	t_Key*		GetKey(t_Str szKey, t_Str szSection);
 				// GetSection: Returns the requested section (if found), NULL otherwise.
 	t_Section*	GetSection(t_Str szSection);
+				// RebuildIndex: Recreates the section index, and the key index of
+				// every section, from the ordered lists.
+	void		RebuildIndex();
+				// RebuildKeyIndex: Recreates the key index of a single section.
+	void		RebuildKeyIndex(t_Section* pSection);
 
 
 // Data
@@ -267,6 +286,7 @@ public:
 
 protected:
 	SectionList	m_Sections;		// Our list of sections
+	IndexMap	m_SectionIndex;	// lower-cased section name -> position in m_Sections
 	t_Str		m_szFileName;	// The filename to write to
 	bool		m_bDirty;		// Tracks whether or not data has changed.
 };
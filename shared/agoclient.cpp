@@ -3,7 +3,20 @@
 
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifndef __FreeBSD__
+#include <sys/inotify.h>
+#endif
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <float.h>
 #include <sstream>
+#include <limits>
 
 #include <jsoncpp/json/reader.h>
 #include "agoclient.h"
@@ -12,13 +25,6 @@ using namespace std;
 using namespace qpid::messaging;
 using namespace qpid::types;
 
-// helper to determine last element
-template <typename Iter>
-Iter next(Iter iter)
-{
-    return ++iter;
-}
-
 bool agocontrol::nameval(const std::string& in, std::string& name, std::string& value) {
 	std::string::size_type i = in.find("=");
         if (i == std::string::npos) {
@@ -55,102 +61,214 @@ std::string agocontrol::float2str(float f) {
 	return sstream.str();
 }
 
-bool agocontrol::variantMapToJSONFile(qpid::types::Variant::Map map, std::string filename) {
+bool agocontrol::variantMapToJSONFile(const qpid::types::Variant::Map &map, const std::string &filename) {
+	// write a temporary file and rename it over the target, so a crash or power
+	// loss during the write never leaves a truncated map behind. mkstemp keeps
+	// concurrent writers apart, the file keeps the mode of the one it replaces
+	std::vector<char> tmptemplate(filename.begin(), filename.end());
+	const char suffix[] = ".XXXXXX";
+	tmptemplate.insert(tmptemplate.end(), suffix, suffix + sizeof(suffix));
+	int fd = mkstemp(&tmptemplate[0]);
+	if (fd == -1) {
+		printf("ERROR: Can't write %s\n",filename.c_str());
+		return false;
+	}
+	std::string tmpname = &tmptemplate[0];
+	struct stat st;
+	fchmod(fd, stat(filename.c_str(), &st) == 0 ? st.st_mode & 07777 : 0644);
+	close(fd);
 	ofstream mapfile;
 	try { 
-		mapfile.open(filename.c_str());
-		mapfile << variantMapToJSONString(map);
+		mapfile.open(tmpname.c_str());
+		variantMapToJSON(map, mapfile);
+		mapfile.flush();
+		bool failed = mapfile.fail();
 		mapfile.close();
+		if (failed || rename(tmpname.c_str(), filename.c_str()) != 0) {
+			printf("ERROR: Can't write %s\n",filename.c_str());
+			unlink(tmpname.c_str());
+			return false;
+		}
 		return true;
 	} catch (...) {
 		printf("ERROR: Can't write %s\n",filename.c_str());
+		unlink(tmpname.c_str());
 		return false;
 	}
 }
 
-qpid::types::Variant::Map agocontrol::jsonFileToVariantMap(std::string filename) {
-	string content;
-	qpid::types::Variant::Map result;
-	ifstream mapfile (filename.c_str());
-	if (mapfile.is_open()) {
-		while (mapfile.good()) {
-			string line;
-			getline(mapfile, line);
-			content += line;
+
+// output targets for the JSON writer, either a string buffer or a stream
+class JSONStringSink {
+	public:
+		JSONStringSink(std::string &_out) : out(_out) {}
+		void put(char c) { out.push_back(c); }
+		void write(const char *data, size_t len) { out.append(data, len); }
+	private:
+		std::string &out;
+};
+
+class JSONStreamSink {
+	public:
+		JSONStreamSink(std::ostream &_out) : out(_out) {}
+		void put(char c) { out.put(c); }
+		void write(const char *data, size_t len) { out.write(data, len); }
+	private:
+		std::ostream &out;
+};
+
+template <typename Sink> static void writeJSONString(Sink &sink, const std::string &value) {
+	static const char hex[] = "0123456789abcdef";
+	const char *data = value.data();
+	size_t len = value.size();
+	size_t start = 0;
+
+	sink.put('"');
+	for (size_t i = 0; i < len; i++) {
+		unsigned char c = data[i];
+		const char *escape = NULL;
+		switch (c) {
+			case '"': escape = "\\\""; break;
+			case '\\': escape = "\\\\"; break;
+			case '\b': escape = "\\b"; break;
+			case '\f': escape = "\\f"; break;
+			case '\n': escape = "\\n"; break;
+			case '\r': escape = "\\r"; break;
+			case '\t': escape = "\\t"; break;
+			default:
+				if (c >= 0x20) continue;
 		}
-		mapfile.close();
+		// flush the unescaped run in one go
+		if (i > start) sink.write(data + start, i - start);
+		if (escape != NULL) {
+			sink.write(escape, 2);
+		} else {
+			char unicode[6] = { '\\', 'u', '0', '0', hex[c >> 4], hex[c & 0xf] };
+			sink.write(unicode, 6);
+		}
+		start = i + 1;
 	}
-	result =  jsonStringToVariantMap(content);
-	return result;
+	if (len > start) sink.write(data + start, len - start);
+	sink.put('"');
 }
 
+template <typename Sink> static void writeJSONNumber(Sink &sink, const char *format, double value) {
+	char buffer[32];
+	if (value != value || value > DBL_MAX || value < -DBL_MAX) {
+		// NaN and infinity have no JSON representation
+		sink.write("null", 4);
+		return;
+	}
+	int len = snprintf(buffer, sizeof(buffer), format, value);
+	sink.write(buffer, len);
+}
 
-std::string agocontrol::variantMapToJSONString(qpid::types::Variant::Map map) {
-	string result;
-	result += "{";
+template <typename Sink> static void writeJSON(Sink &sink, const qpid::types::Variant &value);
+
+template <typename Sink> static void writeJSON(Sink &sink, const qpid::types::Variant::Map &map) {
+	sink.put('{');
 	for (Variant::Map::const_iterator it = map.begin(); it != map.end(); ++it) {
-		result += "\""+ it->first + "\":";
-		std::string tmpstring;
-		switch (it->second.getType()) {
-			case VAR_MAP:
-				result += variantMapToJSONString(it->second.asMap());
-				break;
-			case VAR_LIST:
-				result += variantListToJSONString(it->second.asList());
-				break;
-			case VAR_STRING:
-				tmpstring = it->second.asString();
-				replaceString(tmpstring, "\"", "\\\"");	
-				result += "\"" +  tmpstring + "\"";
-				break;
-			default:
-				if (it->second.asString().size() != 0) {
-					result += it->second.asString();	
-				} else {
-					result += "null";
-				}
-		}
-		if ((it != map.end()) && (next(it) != map.end())) result += ",";
+		if (it != map.begin()) sink.put(',');
+		writeJSONString(sink, it->first);
+		sink.put(':');
+		writeJSON(sink, it->second);
 	}
-	result += "}";
-	
-	return result;
+	sink.put('}');
 }
 
-std::string agocontrol::variantListToJSONString(qpid::types::Variant::List list) {
-	string result;
-	result += "[";
+template <typename Sink> static void writeJSON(Sink &sink, const qpid::types::Variant::List &list) {
+	sink.put('[');
 	for (Variant::List::const_iterator it = list.begin(); it != list.end(); ++it) {
-		std::string tmpstring;
-		switch(it->getType()) {
-			case VAR_MAP:
-				result += variantMapToJSONString(it->asMap());
-				break;
-			case VAR_LIST:
-				result += variantListToJSONString(it->asList());
-				break;
-			case VAR_STRING:
-				tmpstring = it->asString();
-				replaceString(tmpstring, "\"", "\\\"");	
-				result += "\"" +  tmpstring + "\"";
-				break;
-			default:
-				if (it->asString().size() != 0) {
-					result += it->asString();
-				} else {
-					result += "null";
-				}
-		}
-		if ((it != list.end()) && (next(it) != list.end())) result += ",";
+		if (it != list.begin()) sink.put(',');
+		writeJSON(sink, *it);
 	}
-	result += "]";
+	sink.put(']');
+}
+
+template <typename Sink> static void writeJSON(Sink &sink, const qpid::types::Variant &value) {
+	char buffer[32];
+	int len;
+	switch (value.getType()) {
+		case VAR_MAP:
+			writeJSON(sink, value.asMap());
+			break;
+		case VAR_LIST:
+			writeJSON(sink, value.asList());
+			break;
+		case VAR_STRING:
+			writeJSONString(sink, value.getString());
+			break;
+		case VAR_UUID:
+			writeJSONString(sink, value.asString());
+			break;
+		case VAR_BOOL:
+			if (value.asBool()) sink.write("true", 4);
+			else sink.write("false", 5);
+			break;
+		case VAR_UINT8:
+		case VAR_UINT16:
+		case VAR_UINT32:
+		case VAR_UINT64:
+			len = snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)value.asUint64());
+			sink.write(buffer, len);
+			break;
+		case VAR_INT8:
+		case VAR_INT16:
+		case VAR_INT32:
+		case VAR_INT64:
+			len = snprintf(buffer, sizeof(buffer), "%lld", (long long)value.asInt64());
+			sink.write(buffer, len);
+			break;
+		case VAR_FLOAT:
+			writeJSONNumber(sink, "%.9g", value.asFloat());
+			break;
+		case VAR_DOUBLE:
+			writeJSONNumber(sink, "%.17g", value.asDouble());
+			break;
+		default:
+			sink.write("null", 4);
+	}
+}
+
+void agocontrol::variantMapToJSON(const qpid::types::Variant::Map &map, std::string &out) {
+	JSONStringSink sink(out);
+	writeJSON(sink, map);
+}
+
+void agocontrol::variantListToJSON(const qpid::types::Variant::List &list, std::string &out) {
+	JSONStringSink sink(out);
+	writeJSON(sink, list);
+}
+
+void agocontrol::variantToJSON(const qpid::types::Variant &value, std::string &out) {
+	JSONStringSink sink(out);
+	writeJSON(sink, value);
+}
+
+std::ostream& agocontrol::variantMapToJSON(const qpid::types::Variant::Map &map, std::ostream &out) {
+	JSONStreamSink sink(out);
+	writeJSON(sink, map);
+	return out;
+}
+
+std::string agocontrol::variantMapToJSONString(const qpid::types::Variant::Map &map) {
+	string result;
+	result.reserve(4096);
+	variantMapToJSON(map, result);
+	return result;
+}
+
+std::string agocontrol::variantListToJSONString(const qpid::types::Variant::List &list) {
+	string result;
+	result.reserve(1024);
+	variantListToJSON(list, result);
 	return result;
 }
 
-qpid::types::Variant::List agocontrol::jsonToVariantList(Json::Value value) {
+qpid::types::Variant::List agocontrol::jsonToVariantList(const Json::Value &value) {
 	Variant::List list;
 	try {
-		for (Json::ValueIterator it = value.begin(); it != value.end(); it++) {
+		for (Json::ValueConstIterator it = value.begin(); it != value.end(); it++) {
 			switch((*it).type()) {
 				case Json::nullValue:
 					break;
@@ -191,10 +309,10 @@ qpid::types::Variant::List agocontrol::jsonToVariantList(Json::Value value) {
 
 	return list;
 }
-qpid::types::Variant::Map agocontrol::jsonToVariantMap(Json::Value value) {
+qpid::types::Variant::Map agocontrol::jsonToVariantMap(const Json::Value &value) {
 	Variant::Map map;
 	try {
-		for (Json::ValueIterator it = value.begin(); it != value.end(); it++) {
+		for (Json::ValueConstIterator it = value.begin(); it != value.end(); it++) {
 			switch((*it).type()) {
 				case Json::nullValue:
 					break;
@@ -232,24 +350,302 @@ qpid::types::Variant::Map agocontrol::jsonToVariantMap(Json::Value value) {
 	return map;
 }
 
-qpid::types::Variant::Map agocontrol::jsonStringToVariantMap(std::string jsonstring) {
-	Json::Value root;
-	Json::Reader reader;
-	Variant::Map result;
+// builds Variant values directly from JSON text, without an intermediate Json::Value tree.
+// null values are dropped from objects and arrays like the jsoncpp based conversion did.
+class JSONVariantParser {
+	public:
+		JSONVariantParser(const char *data, size_t length) : pos(data), end(data + length), depth(0) {}
+
+		bool parse(Variant &result) {
+			skipWhitespace();
+			if (!parseValue(result)) return false;
+			skipWhitespace();
+			// anything left is trailing data, embedded NUL bytes included
+			return pos == end;
+		}
 
-	try {
-		if ( reader.parse(jsonstring, root)) {
-			result = jsonToVariantMap(root);
-		}/* else { 
-			printf("warning, could not parse json to Variant::Map: %s\n",jsonstring.c_str());
-		}*/
-	} catch (const std::exception& error) {
-                cout << "ERROR! Exception during JSON String->Variant::Map conversion!" << endl;
-                stringstream errorstring;
-                errorstring << error.what();
-                cout << "EXCEPTION: " << errorstring.str() << endl;
-        }
-	return result;
+	private:
+		const char *pos;
+		const char *end;
+		unsigned int depth;
+		std::string key;
+
+		static const unsigned int maxDepth = 512;
+
+		void skipWhitespace() {
+			while (pos < end) {
+				if (*pos == ' ' || *pos == '\t' || *pos == '\n' || *pos == '\r') {
+					pos++;
+				} else if (*pos == '/' && pos + 1 < end && pos[1] == '/') {
+					while (pos < end && *pos != '\n') pos++;
+				} else if (*pos == '/' && pos + 1 < end && pos[1] == '*') {
+					pos += 2;
+					while (pos + 1 < end && !(pos[0] == '*' && pos[1] == '/')) pos++;
+					pos = pos + 1 < end ? pos + 2 : end;
+				} else {
+					break;
+				}
+			}
+		}
+
+		bool literal(const char *word, size_t len) {
+			if ((size_t)(end - pos) < len || memcmp(pos, word, len) != 0) return false;
+			pos += len;
+			return true;
+		}
+
+		bool parseValue(Variant &value) {
+			if (pos >= end) return false;
+			switch (*pos) {
+				case '{':
+					if (++depth > maxDepth) return false;
+					value = Variant::Map();
+					if (!parseObject(value.asMap())) return false;
+					depth--;
+					return true;
+				case '[':
+					if (++depth > maxDepth) return false;
+					value = Variant::List();
+					if (!parseArray(value.asList())) return false;
+					depth--;
+					return true;
+				case '"': {
+					std::string str;
+					if (!parseString(str)) return false;
+					value = str;
+					return true;
+				}
+				case 't':
+					value = true;
+					return literal("true", 4);
+				case 'f':
+					value = false;
+					return literal("false", 5);
+				case 'n':
+					value = Variant();
+					return literal("null", 4);
+				default:
+					return parseNumber(value);
+			}
+		}
+
+		bool parseObject(Variant::Map &map) {
+			pos++;
+			skipWhitespace();
+			if (pos < end && *pos == '}') {
+				pos++;
+				return true;
+			}
+			while (pos < end) {
+				if (*pos != '"' || !parseString(key)) return false;
+				skipWhitespace();
+				if (pos >= end || *pos != ':') return false;
+				pos++;
+				skipWhitespace();
+				Variant &slot = map[key];
+				if (!parseValue(slot)) return false;
+				if (slot.getType() == VAR_VOID) map.erase(key);
+				skipWhitespace();
+				if (pos >= end) return false;
+				if (*pos == '}') {
+					pos++;
+					return true;
+				}
+				if (*pos != ',') return false;
+				pos++;
+				skipWhitespace();
+			}
+			return false;
+		}
+
+		bool parseArray(Variant::List &list) {
+			pos++;
+			skipWhitespace();
+			if (pos < end && *pos == ']') {
+				pos++;
+				return true;
+			}
+			while (pos < end) {
+				list.push_back(Variant());
+				if (!parseValue(list.back())) return false;
+				if (list.back().getType() == VAR_VOID) list.pop_back();
+				skipWhitespace();
+				if (pos >= end) return false;
+				if (*pos == ']') {
+					pos++;
+					return true;
+				}
+				if (*pos != ',') return false;
+				pos++;
+				skipWhitespace();
+			}
+			return false;
+		}
+
+		static int hexDigit(char c) {
+			if (c >= '0' && c <= '9') return c - '0';
+			if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+			if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+			return -1;
+		}
+
+		bool parseHex4(unsigned int &codepoint) {
+			if (end - pos < 4) return false;
+			codepoint = 0;
+			for (int i = 0; i < 4; i++) {
+				int digit = hexDigit(*pos++);
+				if (digit < 0) return false;
+				codepoint = (codepoint << 4) | digit;
+			}
+			return true;
+		}
+
+		static void appendUTF8(std::string &out, unsigned int cp) {
+			if (cp < 0x80) {
+				out.push_back((char)cp);
+			} else if (cp < 0x800) {
+				out.push_back((char)(0xC0 | (cp >> 6)));
+				out.push_back((char)(0x80 | (cp & 0x3F)));
+			} else if (cp < 0x10000) {
+				out.push_back((char)(0xE0 | (cp >> 12)));
+				out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+				out.push_back((char)(0x80 | (cp & 0x3F)));
+			} else {
+				out.push_back((char)(0xF0 | (cp >> 18)));
+				out.push_back((char)(0x80 | ((cp >> 12) & 0x3F)));
+				out.push_back((char)(0x80 | ((cp >> 6) & 0x3F)));
+				out.push_back((char)(0x80 | (cp & 0x3F)));
+			}
+		}
+
+		bool parseString(std::string &out) {
+			out.clear();
+			pos++;
+			while (pos < end) {
+				// copy runs of plain characters in one go
+				const char *start = pos;
+				while (pos < end && *pos != '"' && *pos != '\\') pos++;
+				out.append(start, pos - start);
+				if (pos >= end) return false;
+				if (*pos == '"') {
+					pos++;
+					return true;
+				}
+				if (++pos >= end) return false;
+				switch (*pos++) {
+					case '"': out.push_back('"'); break;
+					case '\\': out.push_back('\\'); break;
+					case '/': out.push_back('/'); break;
+					case 'b': out.push_back('\b'); break;
+					case 'f': out.push_back('\f'); break;
+					case 'n': out.push_back('\n'); break;
+					case 'r': out.push_back('\r'); break;
+					case 't': out.push_back('\t'); break;
+					case 'u': {
+						unsigned int cp;
+						if (!parseHex4(cp)) return false;
+						if (cp >= 0xD800 && cp <= 0xDBFF) {
+							unsigned int low;
+							if (end - pos < 6 || pos[0] != '\\' || pos[1] != 'u') return false;
+							pos += 2;
+							if (!parseHex4(low) || low < 0xDC00 || low > 0xDFFF) return false;
+							cp = 0x10000 + ((cp - 0xD800) << 10) + (low - 0xDC00);
+						}
+						appendUTF8(out, cp);
+						break;
+					}
+					default:
+						return false;
+				}
+			}
+			return false;
+		}
+
+		bool parseNumber(Variant &value) {
+			const char *start = pos;
+			bool negative = false;
+			bool isInteger = true;
+			bool overflow = false;
+			uint64_t magnitude = 0;
+
+			if (*pos == '-') {
+				negative = true;
+				pos++;
+			}
+			if (pos >= end || *pos < '0' || *pos > '9') return false;
+			while (pos < end && *pos >= '0' && *pos <= '9') {
+				unsigned int digit = *pos++ - '0';
+				if (magnitude > (std::numeric_limits<uint64_t>::max() - digit) / 10) overflow = true;
+				else magnitude = magnitude * 10 + digit;
+			}
+			if (pos < end && *pos == '.') {
+				isInteger = false;
+				pos++;
+				if (pos >= end || *pos < '0' || *pos > '9') return false;
+				while (pos < end && *pos >= '0' && *pos <= '9') pos++;
+			}
+			if (pos < end && (*pos == 'e' || *pos == 'E')) {
+				isInteger = false;
+				pos++;
+				if (pos < end && (*pos == '+' || *pos == '-')) pos++;
+				if (pos >= end || *pos < '0' || *pos > '9') return false;
+				while (pos < end && *pos >= '0' && *pos <= '9') pos++;
+			}
+
+			if (isInteger && !overflow) {
+				if (negative) {
+					if (magnitude <= (uint64_t)std::numeric_limits<int32_t>::max() + 1) value = (int32_t)(-(int64_t)magnitude);
+					else if (magnitude <= (uint64_t)std::numeric_limits<int64_t>::max()) value = -(int64_t)magnitude;
+					else if (magnitude == (uint64_t)std::numeric_limits<int64_t>::max() + 1) value = std::numeric_limits<int64_t>::min();
+					else value = -(double)magnitude;
+				} else {
+					if (magnitude <= (uint64_t)std::numeric_limits<int32_t>::max()) value = (int32_t)magnitude;
+					else if (magnitude <= std::numeric_limits<uint32_t>::max()) value = (uint32_t)magnitude;
+					else if (magnitude <= (uint64_t)std::numeric_limits<int64_t>::max()) value = (int64_t)magnitude;
+					else value = magnitude;
+				}
+				return true;
+			}
+
+			// the input is not null terminated, hand strtod a copy of the token
+			std::string number(start, pos - start);
+			value = strtod(number.c_str(), NULL);
+			return true;
+		}
+};
+
+bool agocontrol::jsonBufferToVariant(const char *data, size_t length, qpid::types::Variant &result) {
+	JSONVariantParser parser(data, length);
+	return parser.parse(result);
+}
+
+qpid::types::Variant::Map agocontrol::jsonStringToVariantMap(const std::string &jsonstring) {
+	Variant result;
+	if (jsonBufferToVariant(jsonstring.data(), jsonstring.size(), result) && result.getType() == VAR_MAP) {
+		return result.asMap();
+	}
+	return Variant::Map();
+}
+
+qpid::types::Variant::Map agocontrol::jsonFileToVariantMap(const std::string &filename) {
+	Variant result;
+	struct stat st;
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) return Variant::Map();
+	if (fstat(fd, &st) == 0 && st.st_size > 0) {
+		void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			if (!jsonBufferToVariant((const char *)data, st.st_size, result)) {
+				printf("WARNING: could not parse JSON file %s\n", filename.c_str());
+				result = Variant();
+			}
+			munmap(data, st.st_size);
+		}
+	}
+	close(fd);
+	if (result.getType() == VAR_MAP) return result.asMap();
+	return Variant::Map();
 }
 
 // generates a uuid as string via libuuid
@@ -264,85 +660,760 @@ std::string agocontrol::generateUuid() {
 		strUuid = string(name);
 		free(name);
 	}
-	return strUuid;
+	return strUuid;
+}
+
+// process wide cache of the parsed conf.d files. each file is parsed once and kept
+// until inotify (or a changed mtime where inotify is not available) reports a change.
+class ConfigCache {
+	public:
+		static ConfigCache &instance() {
+			pthread_once(&once, create);
+			return *cache;
+		}
+
+		std::string get(const char *section, const char *option, const char *defaultvalue) {
+			pthread_mutex_lock(&mutex);
+			CDataFile *file = lookup(section);
+			t_Str value = file->GetString(option, section);
+			pthread_mutex_unlock(&mutex);
+			if (value.size() == 0) return defaultvalue;
+			return value;
+		}
+
+		// read-modify-write of a whole batch of options, persisted with one atomic save
+		bool set(const char *section, const Variant::Map &options) {
+			bool result = true;
+			pthread_mutex_lock(&mutex);
+			// always start from the file on disk so concurrent writers don't lose updates
+			CDataFile *file = new CDataFile(filename(section));
+			for (Variant::Map::const_iterator it = options.begin(); it != options.end(); it++) {
+				if (!file->SetValue(it->first, it->second.asString(), "", section)) result = false;
+			}
+			if (result) result = file->Save();
+			if (result) {
+				// consume the notification for our own rename, the new content is already parsed
+				if (inotifyFd >= 0) processEvents();
+				Entry &entry = files[section];
+				delete entry.file;
+				entry.file = file;
+				entry.mtime = modificationTime(section);
+				entry.valid = true;
+				writes++;
+			} else {
+				delete file;
+			}
+			pthread_mutex_unlock(&mutex);
+			return result;
+		}
+
+		Variant::Map stats() {
+			Variant::Map result;
+			pthread_mutex_lock(&mutex);
+			result["hits"] = hits;
+			result["misses"] = misses;
+			result["reloads"] = reloads;
+			result["writes"] = writes;
+			result["files"] = (uint32_t)files.size();
+			result["inotify"] = inotifyFd >= 0;
+			pthread_mutex_unlock(&mutex);
+			return result;
+		}
+
+	private:
+		struct Entry {
+			Entry() : file(NULL), mtime(0), valid(false) {}
+			CDataFile *file;
+			time_t mtime;
+			bool valid;
+		};
+
+		std::map<std::string, Entry> files;
+		pthread_mutex_t mutex;
+		int inotifyFd;
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t reloads;
+		uint64_t writes;
+
+		static pthread_once_t once;
+		static ConfigCache *cache;
+
+		static void create() {
+			cache = new ConfigCache();
+		}
+
+		ConfigCache() : inotifyFd(-1), hits(0), misses(0), reloads(0), writes(0) {
+			pthread_mutex_init(&mutex, NULL);
+#ifndef __FreeBSD__
+			inotifyFd = inotify_init();
+			if (inotifyFd >= 0) {
+				fcntl(inotifyFd, F_SETFL, fcntl(inotifyFd, F_GETFL) | O_NONBLOCK);
+				fcntl(inotifyFd, F_SETFD, FD_CLOEXEC);
+				if (inotify_add_watch(inotifyFd, CONFIG_FILE_PATH, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_DELETE) < 0) {
+					close(inotifyFd);
+					inotifyFd = -1;
+				}
+			}
+#endif
+		}
+
+		static std::string filename(const char *section) {
+			std::string result = CONFIG_FILE_PATH;
+			result += "/";
+			result += section;
+			result += ".conf";
+			return result;
+		}
+
+		static time_t modificationTime(const char *section) {
+			struct stat st;
+			if (stat(filename(section).c_str(), &st) != 0) return 0;
+			return st.st_mtime;
+		}
+
+		// drain pending inotify events and invalidate the files they name
+		void processEvents() {
+#ifndef __FreeBSD__
+			char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+			ssize_t len;
+			while ((len = read(inotifyFd, buffer, sizeof(buffer))) > 0) {
+				for (char *ptr = buffer; ptr < buffer + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event *)ptr)->len) {
+					struct inotify_event *event = (struct inotify_event *)ptr;
+					if (event->len == 0) continue;
+					std::string name = event->name;
+					if (name.size() <= 5 || name.compare(name.size() - 5, 5, ".conf") != 0) continue;
+					std::map<std::string, Entry>::iterator it = files.find(name.substr(0, name.size() - 5));
+					if (it != files.end()) it->second.valid = false;
+				}
+			}
+#endif
+		}
+
+		CDataFile *lookup(const char *section) {
+			if (inotifyFd >= 0) processEvents();
+			std::map<std::string, Entry>::iterator it = files.find(section);
+			if (it != files.end()) {
+				Entry &entry = it->second;
+				if (inotifyFd < 0 && entry.valid && modificationTime(section) != entry.mtime) entry.valid = false;
+				if (entry.valid) {
+					hits++;
+					return entry.file;
+				}
+				reloads++;
+			} else {
+				misses++;
+			}
+			Entry &entry = files[section];
+			delete entry.file;
+			entry.mtime = modificationTime(section);
+			entry.file = new CDataFile(filename(section));
+			entry.valid = true;
+			return entry.file;
+		}
+};
+
+pthread_once_t ConfigCache::once = PTHREAD_ONCE_INIT;
+ConfigCache *ConfigCache::cache = NULL;
+
+std::string agocontrol::getConfigOption(const char *section, const char *option, const char *defaultvalue) {
+	return ConfigCache::instance().get(section, option, defaultvalue);
+}
+
+bool agocontrol::setConfigOptions(const char *section, const qpid::types::Variant::Map &options) {
+	return ConfigCache::instance().set(section, options);
+}
+
+bool agocontrol::setConfigOption(const char* section, const char* option, const char* value) {
+	Variant::Map options;
+	options[option] = value;
+	return setConfigOptions(section, options);
+}
+
+bool agocontrol::setConfigOption(const char* section, const char* option, const float value) {
+	Variant::Map options;
+	char buffer[64];
+	snprintf(buffer, sizeof(buffer), "%f", value);
+	options[option] = buffer;
+	return setConfigOptions(section, options);
+}
+
+bool agocontrol::setConfigOption(const char* section, const char* option, const int value) {
+	Variant::Map options;
+	options[option] = int2str(value);
+	return setConfigOptions(section, options);
+}
+
+bool agocontrol::setConfigOption(const char* section, const char* option, const bool value) {
+	Variant::Map options;
+	options[option] = value ? "True" : "False";
+	return setConfigOptions(section, options);
+}
+
+qpid::types::Variant::Map agocontrol::getConfigCacheStats() {
+	return ConfigCache::instance().stats();
+}
+
+// wall clock in milliseconds
+static uint64_t nowMilliseconds() {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// absolute deadline for pthread_cond_timedwait, ms milliseconds from now
+static void deadlineFromNow(struct timespec &deadline, uint64_t ms) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	deadline.tv_sec = now.tv_sec + ms / 1000;
+	deadline.tv_nsec = now.tv_usec * 1000 + (ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+}
+
+agocontrol::ReplyMultiplexer::ReplyMultiplexer(qpid::messaging::Connection connection, bool adoptUncorrelated) {
+	running = false;
+	this->adoptUncorrelated = adoptUncorrelated;
+	sequence = 0;
+	correlationPrefix = generateUuid() + "-";
+	pthread_mutex_init(&mutex, NULL);
+	pthread_cond_init(&cond, NULL);
+	try {
+		session = connection.createSession();
+		receiver = session.createReceiver("#reply-queue; {create: always, delete: always, node: {type: queue, x-declare: {exclusive: True, auto-delete: True}}}");
+		receiver.setCapacity(100);
+		replyAddress = receiver.getAddress();
+	} catch(const std::exception& error) {
+		std::cerr << error.what() << std::endl;
+		printf("could not create reply queue\n");
+		return;
+	}
+	pthread_mutex_lock(&mutex);
+	running = true;
+	if (pthread_create(&dispatchThread, NULL, dispatcher, this) != 0) {
+		printf("could not start reply dispatcher\n");
+		running = false;
+	}
+	pthread_mutex_unlock(&mutex);
+}
+
+bool agocontrol::ReplyMultiplexer::isRunning() {
+	pthread_mutex_lock(&mutex);
+	bool result = running;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+agocontrol::ReplyMultiplexer::~ReplyMultiplexer() {
+	pthread_mutex_lock(&mutex);
+	bool joinDispatcher = running;
+	running = false;
+	pthread_mutex_unlock(&mutex);
+	if (joinDispatcher) pthread_join(dispatchThread, NULL);
+	try {
+		session.close();
+	} catch(const std::exception& error) {
+		std::cerr << error.what() << std::endl;
+	}
+	pthread_cond_destroy(&cond);
+	pthread_mutex_destroy(&mutex);
+}
+
+void *agocontrol::ReplyMultiplexer::dispatcher(void *param) {
+	((ReplyMultiplexer *)param)->dispatch();
+	return NULL;
+}
+
+void agocontrol::ReplyMultiplexer::dispatch() {
+	while (isRunning()) {
+		try {
+			Message response;
+			if (!receiver.fetch(response, Duration::SECOND)) continue;
+			session.acknowledge(response);
+			pthread_mutex_lock(&mutex);
+			std::map<std::string, PendingReply>::iterator it = pending.find(response.getCorrelationId());
+			if (it == pending.end() && response.getCorrelationId().size() == 0 && adoptUncorrelated) {
+				// responders which don't copy the correlation id answer the oldest request
+				for (std::map<std::string, PendingReply>::iterator candidate = pending.begin(); candidate != pending.end(); candidate++) {
+					if (candidate->second.done) continue;
+					if (it == pending.end() || candidate->second.sequence < it->second.sequence) it = candidate;
+				}
+			}
+			if (it != pending.end()) {
+				it->second.response = response;
+				it->second.done = true;
+				pthread_cond_broadcast(&cond);
+			}
+			pthread_mutex_unlock(&mutex);
+		} catch(const std::exception& error) {
+			std::cerr << error.what() << std::endl;
+			usleep(50);
+		}
+	}
+}
+
+std::string agocontrol::ReplyMultiplexer::send(qpid::messaging::Sender &sender, qpid::messaging::Message &message) {
+	std::string correlationId;
+	pthread_mutex_lock(&mutex);
+	if (!running) {
+		pthread_mutex_unlock(&mutex);
+		throw qpid::messaging::MessagingException("reply queue not available");
+	}
+	correlationId = correlationPrefix + int2str(++sequence);
+	PendingReply reply;
+	reply.sequence = sequence;
+	reply.done = false;
+	pending[correlationId] = reply;
+	pthread_mutex_unlock(&mutex);
+
+	message.setCorrelationId(correlationId);
+	message.setReplyTo(replyAddress);
+	try {
+		sender.send(message);
+	} catch(const std::exception& error) {
+		pthread_mutex_lock(&mutex);
+		pending.erase(correlationId);
+		pthread_mutex_unlock(&mutex);
+		throw;
+	}
+	return correlationId;
+}
+
+bool agocontrol::ReplyMultiplexer::wait(const std::string &correlationId, qpid::messaging::Message &response, qpid::messaging::Duration timeout) {
+	bool result = false;
+	struct timespec deadline;
+	deadlineFromNow(deadline, timeout.getMilliseconds());
+
+	pthread_mutex_lock(&mutex);
+	std::map<std::string, PendingReply>::iterator it = pending.find(correlationId);
+	while (it != pending.end() && !it->second.done) {
+		if (pthread_cond_timedwait(&cond, &mutex, &deadline) == ETIMEDOUT) break;
+		it = pending.find(correlationId);
+	}
+	if (it != pending.end()) {
+		if (it->second.done) {
+			response = it->second.response;
+			result = true;
+		}
+		pending.erase(it);
+	}
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
+
+bool agocontrol::ReplyMultiplexer::request(qpid::messaging::Sender &sender, qpid::messaging::Message &message, qpid::messaging::Message &response, qpid::messaging::Duration timeout) {
+	if (!isRunning()) return false;
+	return wait(send(sender, message), response, timeout);
+}
+
+// numeric value of a Variant, numeric strings included
+static bool variantToNumber(const Variant &value, double &number) {
+	switch (value.getType()) {
+		case VAR_UINT8: case VAR_UINT16: case VAR_UINT32: case VAR_UINT64:
+		case VAR_INT8: case VAR_INT16: case VAR_INT32: case VAR_INT64:
+		case VAR_FLOAT: case VAR_DOUBLE:
+			number = value.asDouble();
+			return true;
+		case VAR_STRING: {
+			const std::string &text = value.getString();
+			char *end = NULL;
+			if (text.size() == 0) return false;
+			number = strtod(text.c_str(), &end);
+			return *end == '\0';
+		}
+		default:
+			return false;
+	}
+}
+
+void agocontrol::SchemaIndex::build(const qpid::types::Variant::Map &schema) {
+	commands.clear();
+	devicetypes.clear();
+	events.clear();
+	Variant::Map::const_iterator section;
+
+	if ((section = schema.find("commands")) != schema.end() && section->second.getType() == VAR_MAP) {
+		for (Variant::Map::const_iterator it = section->second.asMap().begin(); it != section->second.asMap().end(); it++) {
+			ParameterMap &parameters = commands[it->first];
+			if (it->second.getType() != VAR_MAP) continue;
+			Variant::Map::const_iterator params = it->second.asMap().find("parameters");
+			if (params == it->second.asMap().end() || params->second.getType() != VAR_MAP) continue;
+			for (Variant::Map::const_iterator param = params->second.asMap().begin(); param != params->second.asMap().end(); param++) {
+				Parameter &parameter = parameters[param->first];
+				parameter.ranged = false;
+				if (param->second.getType() != VAR_MAP) continue;
+				const Variant::Map &definition = param->second.asMap();
+				Variant::Map::const_iterator field;
+				if ((field = definition.find("type")) != definition.end()) parameter.type = field->second.asString();
+				if ((field = definition.find("range")) != definition.end() && field->second.getType() == VAR_LIST && field->second.asList().size() == 2) {
+					parameter.ranged = variantToNumber(field->second.asList().front(), parameter.min)
+						&& variantToNumber(field->second.asList().back(), parameter.max);
+				}
+				if ((field = definition.find("options")) != definition.end() && field->second.getType() == VAR_LIST) {
+					for (Variant::List::const_iterator option = field->second.asList().begin(); option != field->second.asList().end(); option++) {
+						parameter.options.insert(option->asString());
+					}
+				}
+			}
+		}
+	}
+
+	if ((section = schema.find("devicetypes")) != schema.end() && section->second.getType() == VAR_MAP) {
+		for (Variant::Map::const_iterator it = section->second.asMap().begin(); it != section->second.asMap().end(); it++) {
+			std::set<std::string> &allowed = devicetypes[it->first];
+			if (it->second.getType() != VAR_MAP) continue;
+			Variant::Map::const_iterator list = it->second.asMap().find("commands");
+			if (list == it->second.asMap().end() || list->second.getType() != VAR_LIST) continue;
+			for (Variant::List::const_iterator command = list->second.asList().begin(); command != list->second.asList().end(); command++) {
+				allowed.insert(command->asString());
+			}
+		}
+	}
+
+	// event parameters refer to entries of the values section
+	Variant::Map values;
+	if ((section = schema.find("values")) != schema.end() && section->second.getType() == VAR_MAP) values = section->second.asMap();
+	if ((section = schema.find("events")) != schema.end() && section->second.getType() == VAR_MAP) {
+		for (Variant::Map::const_iterator it = section->second.asMap().begin(); it != section->second.asMap().end(); it++) {
+			Variant::Map &eventValues = events[it->first];
+			if (it->second.getType() != VAR_MAP) continue;
+			Variant::Map::const_iterator list = it->second.asMap().find("parameters");
+			if (list == it->second.asMap().end() || list->second.getType() != VAR_LIST) continue;
+			for (Variant::List::const_iterator param = list->second.asList().begin(); param != list->second.asList().end(); param++) {
+				Variant::Map::const_iterator value = values.find(param->asString());
+				eventValues[param->asString()] = value != values.end() ? value->second : Variant(Variant::Map());
+			}
+		}
+	}
+}
+
+bool agocontrol::SchemaIndex::hasDevicetype(const std::string &devicetype) const {
+	return devicetypes.find(devicetype) != devicetypes.end();
+}
+
+bool agocontrol::SchemaIndex::validateCommand(const std::string &devicetype, const qpid::types::Variant::Map &command, std::string &error) const {
+	Variant::Map::const_iterator name = command.find("command");
+	if (name == command.end() || name->second.asString() == "") {
+		error = "no command given";
+		return false;
+	}
+	boost::unordered_map<std::string, std::set<std::string> >::const_iterator allowed = devicetypes.find(devicetype);
+	if (allowed == devicetypes.end()) {
+		error = "unknown devicetype " + devicetype;
+		return false;
+	}
+	if (allowed->second.find(name->second.asString()) == allowed->second.end()) {
+		error = "command " + name->second.asString() + " not supported by devicetype " + devicetype;
+		return false;
+	}
+	boost::unordered_map<std::string, ParameterMap>::const_iterator parameters = commands.find(name->second.asString());
+	if (parameters == commands.end()) return true; // listed for the device type but not described
+
+	// parameters are optional, only the given ones are checked
+	for (ParameterMap::const_iterator it = parameters->second.begin(); it != parameters->second.end(); it++) {
+		Variant::Map::const_iterator value = command.find(it->first);
+		if (value == command.end() || value->second.isVoid()) continue;
+		const Parameter &parameter = it->second;
+		double number;
+		bool valid = true;
+		if (parameter.type == "integer") {
+			valid = variantToNumber(value->second, number) && number == (double)(int64_t)number;
+		} else if (parameter.type == "float") {
+			valid = variantToNumber(value->second, number);
+		} else if (parameter.type == "boolean") {
+			if (value->second.getType() != VAR_BOOL) {
+				std::string text = value->second.asString();
+				valid = text == "true" || text == "false" || text == "True" || text == "False" || text == "1" || text == "0";
+			}
+		} else if (parameter.type == "option") {
+			valid = parameter.options.empty() || parameter.options.find(value->second.asString()) != parameter.options.end();
+		} else if (parameter.type == "map") {
+			valid = value->second.getType() == VAR_MAP;
+		}
+		if (!valid) {
+			error = "invalid value for parameter " + it->first + " of command " + name->second.asString() + ", expected " + parameter.type;
+			return false;
+		}
+		if (parameter.ranged && (parameter.type == "integer" || parameter.type == "float") && (number < parameter.min || number > parameter.max)) {
+			error = "value of parameter " + it->first + " of command " + name->second.asString() + " out of range";
+			return false;
+		}
+	}
+	return true;
 }
 
-std::string agocontrol::getConfigOption(const char *section, const char *option, const char *defaultvalue) {
-	std::string result;
-	t_Str value = t_Str("");
-	std::stringstream filename;
-	filename  << CONFIG_FILE_PATH;
-	filename << "/";
-	filename << section;
-	filename << ".conf";
-	CDataFile ExistingDF(filename.str().c_str());
-
-	value = ExistingDF.GetString(option, section);
-	if (value.size() == 0)
-		result = defaultvalue;
-	else
-		result = value;
-	return result;
+bool agocontrol::SchemaIndex::getEventSchema(const std::string &event, qpid::types::Variant::Map &values) const {
+	boost::unordered_map<std::string, qpid::types::Variant::Map>::const_iterator it = events.find(event);
+	if (it == events.end()) return false;
+	values = it->second;
+	return true;
 }
 
-bool agocontrol::setConfigOption(const char* section, const char* option, const char* value) {
-    bool result = true;
-    std::stringstream filename;
+agocontrol::InventoryCache::InventoryCache() {
+	sequence = 0;
+	lastSync = 0;
+	lastAttempt = 0;
+	failures = 0;
+	syncing = false;
+	valid = false;
+	pthread_mutex_init(&mutex, NULL);
+}
 
-    filename  << CONFIG_FILE_PATH;
-    filename << "/";
-    filename << section;
-    filename << ".conf";
-    CDataFile ExistingDF(filename.str().c_str());
+agocontrol::InventoryCache::~InventoryCache() {
+	pthread_mutex_destroy(&mutex);
+}
 
-    result = ExistingDF.SetValue(option, value);
+// a top level section of the replica, created when missing. mutex must be held
+qpid::types::Variant::Map &agocontrol::InventoryCache::section(const char *name) {
+	Variant &value = inventory[name];
+	if (value.getType() != VAR_MAP) value = Variant::Map();
+	return value.asMap();
+}
 
-    return result;
+void agocontrol::InventoryCache::apply(const qpid::types::Variant::Map &reply) {
+	Variant::Map::const_iterator full = reply.find("full");
+	Variant::Map::const_iterator devices = reply.find("devices");
+
+	pthread_mutex_lock(&mutex);
+	syncing = false;
+	if (devices == reply.end()) {
+		// no usable answer from the resolver, keep the replica and back off
+		failures++;
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	failures = 0;
+	if (full == reply.end() || full->second.asBool()) {
+		// plain inventory or a full resync, replace everything but a schema the resolver left out as unchanged
+		Variant schema;
+		if (reply.find("schema") == reply.end()) schema = inventory["schema"];
+		inventory = reply;
+		if (!schema.isVoid()) inventory["schema"] = schema;
+		inventory.erase("full");
+		inventory.erase("returncode");
+		inventory.erase("sequence");
+		inventory.erase("epoch");
+		inventory.erase("schemaversion");
+	} else {
+		Variant::Map &localDevices = section("devices");
+		Variant::Map::const_iterator removed = reply.find("removed");
+		if (removed != reply.end() && removed->second.getType() == VAR_LIST) {
+			for (Variant::List::const_iterator it = removed->second.asList().begin(); it != removed->second.asList().end(); it++) {
+				localDevices.erase(it->asString());
+			}
+		}
+		if (devices->second.getType() == VAR_MAP) {
+			for (Variant::Map::const_iterator it = devices->second.asMap().begin(); it != devices->second.asMap().end(); it++) {
+				localDevices[it->first] = it->second;
+			}
+		}
+		const char *sections[] = { "rooms", "floorplans", "variables", "environment", "schema", "system" };
+		for (size_t i = 0; i < sizeof(sections) / sizeof(sections[0]); i++) {
+			Variant::Map::const_iterator it = reply.find(sections[i]);
+			if (it != reply.end()) inventory[sections[i]] = it->second;
+		}
+	}
+	Variant::Map::const_iterator it = reply.find("sequence");
+	sequence = it != reply.end() ? it->second.asUint64() : 0;
+	it = reply.find("epoch");
+	epoch = it != reply.end() ? it->second.asString() : "";
+	it = reply.find("schemaversion");
+	if (it != reply.end()) schemaVersion = it->second.asString();
+	lastSync = time(NULL);
+	valid = true;
+	pthread_mutex_unlock(&mutex);
 }
 
-bool agocontrol::setConfigOption(const char* section, const char* option, const float value) {
-    bool result = true;
-    std::stringstream filename;
+// merge one announced device into the replica, content holds devicetype and internalid
+static void applyAnnounce(Variant::Map &devices, const std::string &uuid, const Variant::Map &content, const std::string &handledBy) {
+	Variant::Map::const_iterator it;
+	Variant &entry = devices[uuid];
+	if (entry.getType() != VAR_MAP) {
+		// name and room are only known to the resolver, the next sync fills them in
+		Variant::Map device;
+		device["name"] = "";
+		device["room"] = "";
+		device["state"] = "0";
+		device["values"] = Variant::Map();
+		entry = device;
+	}
+	Variant::Map &device = entry.asMap();
+	if ((it = content.find("devicetype")) != content.end()) device["devicetype"] = it->second.asString();
+	if ((it = content.find("internalid")) != content.end()) device["internalid"] = it->second.asString();
+	if (handledBy != "") device["handled-by"] = handledBy;
+	device["lastseen"] = (uint64_t)time(NULL);
+	device["stale"] = 0;
+}
 
-    filename  << CONFIG_FILE_PATH;
-    filename << "/";
-    filename << section;
-    filename << ".conf";
-    CDataFile ExistingDF(filename.str().c_str());
+void agocontrol::InventoryCache::handleEvent(const std::string &subject, const qpid::types::Variant::Map &content) {
+	Variant::Map::const_iterator uuidIt = content.find("uuid");
+	std::string uuid = uuidIt != content.end() ? uuidIt->second.asString() : "";
+	Variant::Map::const_iterator it;
 
-    result = ExistingDF.SetFloat(option, value);
+	pthread_mutex_lock(&mutex);
+	if (!valid) {
+		// nothing to update before the first sync
+		pthread_mutex_unlock(&mutex);
+		return;
+	}
+	Variant::Map &devices = section("devices");
+	Variant::Map &variables = section("variables");
 
-    return result;
+	if (subject == "event.device.announce") {
+		if (uuid != "") {
+			it = content.find("handled-by");
+			applyAnnounce(devices, uuid, content, it != content.end() ? it->second.asString() : "");
+		}
+	} else if (subject == "event.device.announcelist") {
+		it = content.find("handled-by");
+		std::string handledBy = it != content.end() ? it->second.asString() : "";
+		if ((it = content.find("devices")) != content.end() && it->second.getType() == VAR_MAP) {
+			const Variant::Map &announced = it->second.asMap();
+			for (Variant::Map::const_iterator device = announced.begin(); device != announced.end(); device++) {
+				if (device->second.getType() == VAR_MAP) applyAnnounce(devices, device->first, device->second.asMap(), handledBy);
+			}
+		}
+	} else if (subject == "event.device.remove") {
+		devices.erase(uuid);
+	} else if (subject == "event.environment.timechanged") {
+		const char *names[] = { "hour", "day", "weekday", "minute", "month" };
+		for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+			if ((it = content.find(names[i])) != content.end()) variables[names[i]] = it->second.asString();
+		}
+	} else if (subject == "event.system.variablechanged") {
+		if ((it = content.find("variable")) != content.end()) {
+			Variant::Map::const_iterator value = content.find("value");
+			variables[it->second.asString()] = value != content.end() ? value->second.asString() : "";
+		}
+	} else if (subject == "event.system.variabledeleted") {
+		if ((it = content.find("variable")) != content.end()) variables.erase(it->second.asString());
+	} else if (subject == "event.system.roomnamechanged") {
+		Variant &room = section("rooms")[uuid];
+		if (room.getType() != VAR_MAP) room = Variant::Map();
+		if ((it = content.find("name")) != content.end()) room.asMap()["name"] = it->second;
+	} else if (subject == "event.system.roomdeleted") {
+		section("rooms").erase(uuid);
+	} else {
+		if (subject == "event.environment.positionchanged") {
+			Variant::Map &environment = section("environment");
+			if ((it = content.find("latitude")) != content.end()) environment["latitude"] = it->second;
+			if ((it = content.find("longitude")) != content.end()) environment["longitude"] = it->second;
+		}
+		Variant::Map::iterator deviceIt = uuid != "" ? devices.find(uuid) : devices.end();
+		if (deviceIt != devices.end() && deviceIt->second.getType() == VAR_MAP) {
+			Variant::Map &device = deviceIt->second.asMap();
+			if (subject == "event.system.devicenamechanged") {
+				if ((it = content.find("name")) != content.end()) device["name"] = it->second;
+			} else if (subject == "event.system.deviceroomchanged") {
+				if ((it = content.find("room")) != content.end()) device["room"] = it->second;
+			} else if (device["values"].getType() == VAR_MAP) {
+				// same updates as the resolver's handleEvent
+				Variant::Map &values = device["values"].asMap();
+				std::stringstream timestamp;
+				timestamp << time(NULL);
+				if ((subject == "event.device.statechanged") || (subject == "event.security.sensortriggered")) {
+					if ((it = content.find("level")) != content.end()) {
+						values["state"] = it->second;
+						device["state"] = it->second;
+						device["state"].setEncoding("utf8");
+					}
+				} else if (subject == "event.environment.positionchanged") {
+					Variant::Map value;
+					if ((it = content.find("unit")) != content.end()) value["unit"] = it->second;
+					if ((it = content.find("latitude")) != content.end()) value["latitude"] = it->second;
+					if ((it = content.find("longitude")) != content.end()) value["longitude"] = it->second;
+					value["timestamp"] = timestamp.str();
+					values["position"] = value;
+				} else if ((subject.find("event.environment.") == 0) && (subject.size() > 25) && (subject.compare(subject.size() - 7, 7, "changed") == 0)) {
+					Variant::Map value;
+					std::string quantity = subject.substr(18, subject.size() - 25);
+					if ((it = content.find("unit")) != content.end()) value["unit"] = it->second;
+					if ((it = content.find("level")) != content.end()) value["level"] = it->second;
+					value["timestamp"] = timestamp.str();
+					values[quantity] = value;
+				}
+			}
+		}
+	}
+	pthread_mutex_unlock(&mutex);
 }
 
-bool agocontrol::setConfigOption(const char* section, const char* option, const int value) {
-    bool result = true;
-    std::stringstream filename;
-
-    filename  << CONFIG_FILE_PATH;
-    filename << "/";
-    filename << section;
-    filename << ".conf";
-    CDataFile ExistingDF(filename.str().c_str());
+bool agocontrol::InventoryCache::needsSync(unsigned int maxAge) {
+	time_t now = time(NULL);
+	pthread_mutex_lock(&mutex);
+	bool result = !syncing && (!valid || now - lastSync >= (time_t)maxAge);
+	if (result && failures > 0) {
+		// 5s after the first failure, doubling up to maxAge
+		time_t delay = (time_t)5 << (failures < 8 ? failures - 1 : 7);
+		if (delay > (time_t)maxAge && maxAge >= 5) delay = maxAge;
+		result = now - lastAttempt >= delay;
+	}
+	if (result) {
+		syncing = true;
+		lastAttempt = now;
+	}
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
 
-    result = ExistingDF.SetInt(option, value);
+uint64_t agocontrol::InventoryCache::getSequence() {
+	pthread_mutex_lock(&mutex);
+	uint64_t result = valid ? sequence : 0;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
 
-    return result;
+std::string agocontrol::InventoryCache::getSchemaVersion() {
+	pthread_mutex_lock(&mutex);
+	std::string result = schemaVersion;
+	pthread_mutex_unlock(&mutex);
+	return result;
 }
 
-bool agocontrol::setConfigOption(const char* section, const char* option, const bool value) {
-    bool result = true;
-    std::stringstream filename;
+std::string agocontrol::InventoryCache::getEpoch() {
+	pthread_mutex_lock(&mutex);
+	std::string result = epoch;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
 
-    filename  << CONFIG_FILE_PATH;
-    filename << "/";
-    filename << section;
-    filename << ".conf";
-    CDataFile ExistingDF(filename.str().c_str());
+qpid::types::Variant::Map agocontrol::InventoryCache::getInventory() {
+	pthread_mutex_lock(&mutex);
+	Variant::Map result = inventory;
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
 
-    result = ExistingDF.SetBool(option, value);
+bool agocontrol::InventoryCache::getDevice(const std::string &uuid, qpid::types::Variant::Map &device) {
+	bool result = false;
+	pthread_mutex_lock(&mutex);
+	Variant::Map::const_iterator devices = inventory.find("devices");
+	if (devices != inventory.end() && devices->second.getType() == VAR_MAP) {
+		Variant::Map::const_iterator it = devices->second.asMap().find(uuid);
+		if (it != devices->second.asMap().end() && it->second.getType() == VAR_MAP) {
+			device = it->second.asMap();
+			result = true;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return result;
+}
 
-    return result;
+bool agocontrol::InventoryCache::getVariable(const std::string &name, qpid::types::Variant &value) {
+	bool result = false;
+	pthread_mutex_lock(&mutex);
+	Variant::Map::const_iterator variables = inventory.find("variables");
+	if (variables != inventory.end() && variables->second.getType() == VAR_MAP) {
+		Variant::Map::const_iterator it = variables->second.asMap().find(name);
+		if (it != variables->second.asMap().end()) {
+			value = it->second;
+			result = true;
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return result;
 }
 
 agocontrol::AgoConnection::AgoConnection(const char *interfacename) {
@@ -354,7 +1425,30 @@ agocontrol::AgoConnection::AgoConnection(const char *interfacename) {
 	filterCommands = true; // only pass commands for child devices to handler by default
 	commandHandler = NULL;
 	eventHandler = NULL;
+	replies = NULL;
+	pthread_mutex_init(&repliesMutex, NULL);
+	pthread_mutex_init(&replyMutex, NULL);
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&deviceMutex, &attr);
+	pthread_mutexattr_destroy(&attr);
+	useWorkerPool = false;
+	eventLane = NULL;
+	batchEvents = false;
+	coalesceEvents = false;
+	maxBatch = 0;
+	batchInterval = 0;
+	flushThreadRunning = false;
+	pthread_mutex_init(&eventMutex, NULL);
+	pthread_mutex_init(&flushMutex, NULL);
+	pthread_cond_init(&eventCond, NULL);
+	inventoryCache = NULL;
+	inventoryResync = 60;
+	pthread_mutex_init(&inventoryCacheMutex, NULL);
 	instance = interfacename;
+	discoverDue = 0;
+	discoverSeed = time(NULL) ^ getpid() ^ boost::hash<std::string>()(instance);
 
 	uuidMapFile = CONFDIR "/uuidmap/";
 	uuidMapFile += interfacename;
@@ -366,15 +1460,36 @@ agocontrol::AgoConnection::AgoConnection(const char *interfacename) {
 		connection.open(); 
 		session = connection.createSession(); 
 		sender = session.createSender("agocontrol; {create: always, node: {type: topic}}"); 
+		replySession = connection.createSession();
 	} catch(const std::exception& error) {
 		std::cerr << error.what() << std::endl;
 		connection.close();
 		printf("could not connect to broker\n");
 		_exit(1);
 	}
+
+	int eventbatch = atoi(getConfigOption(interfacename, "eventbatch", "0").c_str());
+	if (eventbatch > 0) {
+		setEventBatching(eventbatch, atoi(getConfigOption(interfacename, "eventbatchinterval", "100").c_str()),
+			atoi(getConfigOption(interfacename, "coalesceevents", "0").c_str()) == 1);
+	}
 }
 
 agocontrol::AgoConnection::~AgoConnection() {
+	// handlers may still use the connection, the reply multiplexer and the inventory cache
+	stopWorkerPool();
+	if (batchEvents) {
+		pthread_mutex_lock(&eventMutex);
+		batchEvents = false;
+		pthread_cond_signal(&eventCond);
+		pthread_mutex_unlock(&eventMutex);
+		if (flushThreadRunning) pthread_join(flushThread, NULL);
+		flushEvents();
+	}
+	if (replies != NULL) delete replies;
+	pthread_mutex_destroy(&repliesMutex);
+	if (inventoryCache != NULL) delete inventoryCache;
+	pthread_mutex_destroy(&inventoryCacheMutex);
 	try {
 		connection.close();
 	} catch(const std::exception& error) {
@@ -392,10 +1507,22 @@ void agocontrol::AgoConnection::run() {
 		_exit(1);
 	}
 	// reportDevices(); // this is obsolete as it is handled by addDevice 
+	if (useWorkerPool) startWorkerPool();
 	while( true ) {
+		// answer a pending discover once its jittered delay is over, and don't sleep past it
+		Duration timeout = Duration::SECOND * 3;
+		if (discoverDue != 0) {
+			uint64_t now = nowMilliseconds();
+			if (now >= discoverDue) {
+				discoverDue = 0;
+				reportDevices();
+			} else if (discoverDue - now < timeout.getMilliseconds()) {
+				timeout = Duration(discoverDue - now);
+			}
+		}
 		try{
 			Variant::Map content;
-			Message message = receiver.fetch(Duration::SECOND * 3);
+			Message message = receiver.fetch(timeout);
 			session.acknowledge();
 
 			// workaround for bug qpid-3445
@@ -407,42 +1534,52 @@ void agocontrol::AgoConnection::run() {
 			// std::cout << content << std::endl;
 
 			if (content["command"] == "discover") {
-				reportDevices(); // make resolver happy and announce devices on discover request
+				scheduleDiscoverReply(content); // make resolver happy and announce devices on discover request
 			} else {
 				if (message.getSubject().size() == 0) {
 					// no subject, this is a command
 					string internalid = uuidToInternalId(content["uuid"].asString());
 					// lets see if this is for one of our devices
-					bool isOurDevice = (internalid.size() > 0) && (deviceMap.find(internalIdToUuid(internalid)) != deviceMap.end());
+					bool isOurDevice = false;
+					if (internalid.size() > 0) {
+						pthread_mutex_lock(&deviceMutex);
+						isOurDevice = deviceMap.find(internalIdToUuid(internalid)) != deviceMap.end();
+						pthread_mutex_unlock(&deviceMutex);
+					}
 					//  only handle if a command handler is set. In addition it needs to be one of our device when the filter is enabled
 					if ( ( isOurDevice || (!(filterCommands))) && commandHandler != NULL) {
 
 						// printf("command for id %s found, calling handler\n", internalid.c_str());
 						if (internalid.size() > 0) content["internalid"] = internalid;
-						qpid::types::Variant::Map responsemap = commandHandler(content);
-						// found a match, reply to sender and pass the command to the assigned handler method
-						const Address& replyaddress = message.getReplyTo();
-						// only send a reply if this was for one of our childs
-						// or if it was the special command inventory when the filterCommands was false, that's used by the resolver
-						// to reply to "anonymous" requests not destined to any specific uuid
-						if ((replyaddress && isOurDevice) || (content["command"]=="inventory" && filterCommands==false)) {
-							// std::cout << "sending reply" << std::endl;
-							Session replysession = connection.createSession();
-							try {
-								Sender replysender = replysession.createSender(replyaddress);
-								Message response;
-								encode(responsemap, response);
-								response.setSubject(instance);
-								replysender.send(response);
-								replysession.close();
-							} catch(const std::exception& error) {
-								printf("can't send reply\n");
-								replysession.close();
-							}
-						} 
+						if (useWorkerPool) {
+							DispatchItem item;
+							item.content.swap(content);
+							item.replyaddress = message.getReplyTo();
+							item.correlationId = message.getCorrelationId();
+							item.isOurDevice = isOurDevice;
+							queueItem(commandLanes[boost::hash<std::string>()(internalid) % commandLanes.size()], item);
+						} else {
+							handleCommand(content, message.getReplyTo(), message.getCorrelationId(), isOurDevice);
+						}
+					}
+				} else {
+					// keep the inventory replica current before handlers look at it
+					pthread_mutex_lock(&inventoryCacheMutex);
+					InventoryCache *cache = inventoryCache;
+					pthread_mutex_unlock(&inventoryCacheMutex);
+					if (cache != NULL) cache->handleEvent(message.getSubject(), content);
+
+					if (eventHandler != NULL) {
+						if (useWorkerPool) {
+							DispatchItem item;
+							item.subject = message.getSubject();
+							item.content.swap(content);
+							item.isOurDevice = false;
+							queueItem(eventLane, item);
+						} else {
+							eventHandler(message.getSubject(), content);
+						}
 					}
-				} else if (eventHandler != NULL) {
-					eventHandler(message.getSubject(), content);
 				}
 			}
 		} catch(const NoMessageAvailable& error) {
@@ -461,6 +1598,161 @@ void agocontrol::AgoConnection::run() {
 		}
 	}
 }
+void agocontrol::AgoConnection::handleCommand(qpid::types::Variant::Map &content, const qpid::messaging::Address &replyaddress, const std::string &correlationId, bool isOurDevice) {
+	qpid::types::Variant::Map responsemap = commandHandler(content);
+	// found a match, reply to sender and pass the command to the assigned handler method
+	// only send a reply if this was for one of our childs
+	// or if the filterCommands was false and the handler answered, that's used by the resolver
+	// to reply to "anonymous" requests (inventory, getinventorydelta) not destined to any specific uuid
+	if (replyaddress && (isOurDevice || (filterCommands==false && responsemap.size() > 0))) {
+		// std::cout << "sending reply" << std::endl;
+		Message response;
+		encode(responsemap, response);
+		response.setSubject(instance);
+		response.setCorrelationId(correlationId);
+		if (!sendReply(replyaddress, response)) printf("can't send reply\n");
+	}
+}
+
+bool agocontrol::AgoConnection::setWorkerPool(bool enable) {
+	useWorkerPool = enable;
+	return useWorkerPool;
+}
+
+void agocontrol::AgoConnection::startWorkerPool() {
+	int threads = atoi(getConfigOption(instance.c_str(), "dispatchthreads", getConfigOption("system", "dispatchthreads", "4").c_str()).c_str());
+	if (threads < 1) threads = 1;
+	for (int i = 0; i <= threads; i++) {
+		DispatchLane *lane = new DispatchLane;
+		lane->connection = this;
+		lane->stopping = false;
+		pthread_mutex_init(&lane->mutex, NULL);
+		pthread_cond_init(&lane->cond, NULL);
+		if (pthread_create(&lane->thread, NULL, dispatchWorker, lane) != 0) {
+			printf("could not start dispatch thread, falling back to inline dispatch\n");
+			pthread_cond_destroy(&lane->cond);
+			pthread_mutex_destroy(&lane->mutex);
+			delete lane;
+			stopWorkerPool();
+			useWorkerPool = false;
+			return;
+		}
+		if (i < threads) {
+			commandLanes.push_back(lane);
+		} else {
+			eventLane = lane;
+		}
+	}
+}
+
+void agocontrol::AgoConnection::stopWorkerPool() {
+	std::vector<DispatchLane *> lanes(commandLanes);
+	if (eventLane != NULL) lanes.push_back(eventLane);
+	for (std::vector<DispatchLane *>::iterator lane = lanes.begin(); lane != lanes.end(); lane++) {
+		pthread_mutex_lock(&(*lane)->mutex);
+		(*lane)->stopping = true;
+		pthread_cond_broadcast(&(*lane)->cond);
+		pthread_mutex_unlock(&(*lane)->mutex);
+	}
+	for (std::vector<DispatchLane *>::iterator lane = lanes.begin(); lane != lanes.end(); lane++) {
+		pthread_join((*lane)->thread, NULL);
+		pthread_cond_destroy(&(*lane)->cond);
+		pthread_mutex_destroy(&(*lane)->mutex);
+		delete *lane;
+	}
+	commandLanes.clear();
+	eventLane = NULL;
+}
+
+void agocontrol::AgoConnection::queueItem(DispatchLane *lane, DispatchItem &item) {
+	pthread_mutex_lock(&lane->mutex);
+	lane->queue.push_back(DispatchItem());
+	DispatchItem &queued = lane->queue.back();
+	queued.subject = item.subject;
+	queued.content.swap(item.content);
+	queued.replyaddress = item.replyaddress;
+	queued.correlationId = item.correlationId;
+	queued.isOurDevice = item.isOurDevice;
+	pthread_cond_signal(&lane->cond);
+	pthread_mutex_unlock(&lane->mutex);
+}
+
+void *agocontrol::AgoConnection::dispatchWorker(void *param) {
+	DispatchLane *lane = (DispatchLane *)param;
+	while (true) {
+		DispatchItem item;
+		pthread_mutex_lock(&lane->mutex);
+		while (lane->queue.empty() && !lane->stopping) pthread_cond_wait(&lane->cond, &lane->mutex);
+		if (lane->queue.empty()) {
+			pthread_mutex_unlock(&lane->mutex);
+			break;
+		}
+		DispatchItem &next = lane->queue.front();
+		item.subject = next.subject;
+		item.content.swap(next.content);
+		item.replyaddress = next.replyaddress;
+		item.correlationId = next.correlationId;
+		item.isOurDevice = next.isOurDevice;
+		lane->queue.pop_front();
+		pthread_mutex_unlock(&lane->mutex);
+
+		try {
+			if (item.subject.size() == 0) {
+				lane->connection->handleCommand(item.content, item.replyaddress, item.correlationId, item.isOurDevice);
+			} else {
+				lane->connection->eventHandler(item.subject, item.content);
+			}
+		} catch(const std::exception& error) {
+			std::cerr << error.what() << std::endl;
+		}
+	}
+	return NULL;
+}
+
+bool agocontrol::AgoConnection::sendReply(const qpid::messaging::Address &replyaddress, qpid::messaging::Message &response) {
+	pthread_mutex_lock(&replyMutex);
+	bool result = sendReplyLocked(replyaddress, response);
+	pthread_mutex_unlock(&replyMutex);
+	return result;
+}
+
+bool agocontrol::AgoConnection::sendReplyLocked(const qpid::messaging::Address &replyaddress, qpid::messaging::Message &response) {
+	std::string key = replyaddress.str();
+	// retry once with a fresh sender, the cached one might point to a reply queue that got deleted
+	for (int attempt = 0; attempt < 2; attempt++) {
+		try {
+			std::map<std::string, Sender>::iterator it = replySenders.find(key);
+			if (it == replySenders.end()) {
+				if (replySenders.size() >= 64) {
+					// requesters come and go, don't let stale senders pile up
+					for (it = replySenders.begin(); it != replySenders.end(); it++) {
+						try {
+							it->second.close();
+						} catch(const std::exception& error) {
+						}
+					}
+					replySenders.clear();
+				}
+				it = replySenders.insert(std::make_pair(key, replySession.createSender(replyaddress))).first;
+			}
+			it->second.send(response);
+			return true;
+		} catch(const std::exception& error) {
+			std::cerr << error.what() << std::endl;
+			replySenders.erase(key);
+			if (replySession.hasError()) {
+				try {
+					replySession.close();
+				} catch(const std::exception& error) {
+				}
+				replySenders.clear();
+				replySession = connection.createSession();
+			}
+		}
+	}
+	return false;
+}
+
 bool agocontrol::AgoConnection::emitDeviceAnnounce(const char *internalId, const char *deviceType) {
 	Variant::Map content;
 	Message event;
@@ -472,7 +1764,7 @@ bool agocontrol::AgoConnection::emitDeviceAnnounce(const char *internalId, const
 	encode(content, event);
 	event.setSubject("event.device.announce");
 	try {
-		sender.send(event);
+		sendDirect(event);
 	} catch(const std::exception& error) {
 		std::cerr << error.what() << std::endl;
 		return false;
@@ -488,7 +1780,7 @@ bool agocontrol::AgoConnection::emitDeviceRemove(const char *internalId) {
 	encode(content, event);
 	event.setSubject("event.device.remove");
 	try {
-		sender.send(event);
+		sendDirect(event);
 	} catch(const std::exception& error) {
 		std::cerr << error.what() << std::endl;
 		return false;
@@ -498,58 +1790,132 @@ bool agocontrol::AgoConnection::emitDeviceRemove(const char *internalId) {
 
 bool agocontrol::AgoConnection::addDevice(const char *internalId, const char *deviceType, bool passuuid) {
 	if (!passuuid) return addDevice(internalId, deviceType);
-	uuidMap[internalId] = internalId;
-	storeUuidMap();
+	pthread_mutex_lock(&deviceMutex);
+	if (uuidToInternalId(internalId) != internalId) {
+		addUuidMapping(internalId, internalId);
+		storeUuidMap();
+	}
+	pthread_mutex_unlock(&deviceMutex);
 	return addDevice(internalId, deviceType);
 
 }
 
 bool agocontrol::AgoConnection::addDevice(const char *internalId, const char *deviceType) {
-	if (internalIdToUuid(internalId).size()==0) {
+	pthread_mutex_lock(&deviceMutex);
+	string uuid = internalIdToUuid(internalId);
+	if (uuid.size()==0) {
 		// need to generate new uuid
-		uuidMap[generateUuid()] = internalId;
+		uuid = generateUuid();
+		addUuidMapping(uuid, internalId);
 		storeUuidMap();
 	}
 	Variant::Map device;
 	device["devicetype"] = deviceType;
 	device["internalid"] = internalId;
-	deviceMap[internalIdToUuid(internalId)] = device;
+	deviceMap[uuid] = device;
+	pthread_mutex_unlock(&deviceMutex);
 	emitDeviceAnnounce(internalId, deviceType);
 	return true;
 }
 
 bool agocontrol::AgoConnection::removeDevice(const char *internalId) {
-	if (internalIdToUuid(internalId).size()!=0) {
+	string uuid = internalIdToUuid(internalId);
+	if (uuid.size()!=0) {
 		emitDeviceRemove(internalId);
-		Variant::Map::const_iterator it = deviceMap.find(internalIdToUuid(internalId));
-		if (it != deviceMap.end()) deviceMap.erase(it->first);
-		// deviceMap[internalIdToUuid(internalId)] = device;
+		pthread_mutex_lock(&deviceMutex);
+		Variant::Map::iterator it = deviceMap.find(uuid);
+		if (it != deviceMap.end()) deviceMap.erase(it);
+		pthread_mutex_unlock(&deviceMutex);
 		return true;
 	} else return false;
 }
 
-std::string agocontrol::AgoConnection::uuidToInternalId(std::string uuid) {
-	return uuidMap[uuid].asString();
+std::string agocontrol::AgoConnection::uuidToInternalId(const std::string &uuid) {
+	string result;
+	pthread_mutex_lock(&deviceMutex);
+	boost::unordered_map<std::string, std::string>::const_iterator it = uuidIndex.find(uuid);
+	if (it != uuidIndex.end()) result = it->second;
+	pthread_mutex_unlock(&deviceMutex);
+	return result;
 } 
 
-std::string agocontrol::AgoConnection::internalIdToUuid(std::string internalId) {
+std::string agocontrol::AgoConnection::internalIdToUuid(const std::string &internalId) {
 	string result;
+	pthread_mutex_lock(&deviceMutex);
+	boost::unordered_map<std::string, std::string>::const_iterator it = internalIdIndex.find(internalId);
+	if (it != internalIdIndex.end()) result = it->second;
+	pthread_mutex_unlock(&deviceMutex);
+	return result;
+}
+
+void agocontrol::AgoConnection::rebuildUuidIndex() {
+	uuidIndex.clear();
+	internalIdIndex.clear();
+	uuidIndex.rehash(uuidMap.size());
+	internalIdIndex.rehash(uuidMap.size());
 	for (Variant::Map::const_iterator it = uuidMap.begin(); it != uuidMap.end(); ++it) {
-		if (it->second.asString() == internalId) return it->first;
+		if (it->second.isVoid()) continue;
+		string internalId = it->second.asString();
+		uuidIndex[it->first] = internalId;
+		// uuidMap is ordered, so when several uuids share an internal id the first one wins,
+		// which is what the former linear scan returned
+		internalIdIndex.insert(std::make_pair(internalId, it->first));
 	}
-	return result;
+}
+
+void agocontrol::AgoConnection::addUuidMapping(const std::string &uuid, const std::string &internalId) {
+	boost::unordered_map<std::string, std::string>::iterator old = uuidIndex.find(uuid);
+	if (old != uuidIndex.end() && old->second != internalId) {
+		// uuid gets remapped, the reverse entry of the old internal id is no longer valid
+		uuidMap[uuid] = internalId;
+		rebuildUuidIndex();
+		return;
+	}
+	uuidMap[uuid] = internalId;
+	uuidIndex[uuid] = internalId;
+	boost::unordered_map<std::string, std::string>::iterator it = internalIdIndex.find(internalId);
+	if (it == internalIdIndex.end()) {
+		internalIdIndex[internalId] = uuid;
+	} else if (uuid < it->second) {
+		it->second = uuid;
+	}
+}
+
+void agocontrol::AgoConnection::scheduleDiscoverReply(const qpid::types::Variant::Map &content) {
+	// a targeted discover only asks the listed instances to announce again
+	Variant::Map::const_iterator it = content.find("targets");
+	if (it != content.end() && it->second.getType() == VAR_LIST) {
+		bool targeted = false;
+		const Variant::List &targets = it->second.asList();
+		for (Variant::List::const_iterator target = targets.begin(); target != targets.end(); target++) {
+			if (target->asString() == instance) targeted = true;
+		}
+		if (!targeted) return;
+	}
+	// spread the replies of all drivers over the jitter window (milliseconds)
+	unsigned int jitter = 0;
+	if ((it = content.find("jitter")) != content.end()) jitter = atoi(it->second.asString().c_str());
+	uint64_t due = nowMilliseconds() + (jitter > 0 ? rand_r(&discoverSeed) % jitter : 0);
+	if (discoverDue == 0 || due < discoverDue) discoverDue = due;
 }
 
 void agocontrol::AgoConnection::reportDevices() {
-	for (Variant::Map::const_iterator it = deviceMap.begin(); it != deviceMap.end(); ++it) {
-		Variant::Map device;
-		Variant::Map content;
-		Message event;
+	pthread_mutex_lock(&deviceMutex);
+	Variant::Map devices = deviceMap;
+	pthread_mutex_unlock(&deviceMutex);
+	if (devices.size() == 0) return;
 
-		// printf("uuid: %s\n", it->first.c_str());
-		device = it->second.asMap();
-		// printf("devicetype: %s\n", device["devicetype"].asString().c_str());
-		emitDeviceAnnounce(device["internalid"].asString().c_str(), device["devicetype"].asString().c_str());
+	// one message for all devices, deviceMap entries already hold devicetype and internalid
+	Variant::Map content;
+	Message event;
+	content["handled-by"] = instance;
+	content["devices"] = devices;
+	encode(content, event);
+	event.setSubject("event.device.announcelist");
+	try {
+		sendDirect(event);
+	} catch(const std::exception& error) {
+		std::cerr << error.what() << std::endl;
 	}
 }
 
@@ -562,17 +1928,8 @@ bool agocontrol::AgoConnection::storeUuidMap() {
 }
 
 bool agocontrol::AgoConnection::loadUuidMap() {
-	string content;
-	ifstream mapfile (uuidMapFile.c_str());
-	if (mapfile.is_open()) {
-		while (mapfile.good()) {
-			string line;
-			getline(mapfile, line);
-			content += line;
-		}
-		mapfile.close();
-	}
-	uuidMap = jsonStringToVariantMap(content);
+	uuidMap = jsonFileToVariantMap(uuidMapFile);
+	rebuildUuidIndex();
 	return true;
 }
 
@@ -587,7 +1944,7 @@ bool agocontrol::AgoConnection::sendMessage(const char *subject, qpid::types::Va
 	try {
 		encode(content, message);
 		message.setSubject(subject);
-		sender.send(message);
+		sendDirect(message);
 	} catch(const std::exception& error) {
 		std::cerr << error.what() << std::endl;
 		return false;
@@ -596,35 +1953,35 @@ bool agocontrol::AgoConnection::sendMessage(const char *subject, qpid::types::Va
 	return true;
 }
 
+agocontrol::ReplyMultiplexer *agocontrol::AgoConnection::getReplyMultiplexer() {
+	pthread_mutex_lock(&repliesMutex);
+	// all in-tree responders copy the correlation id, replies without one are dropped
+	if (replies == NULL) replies = new ReplyMultiplexer(connection);
+	pthread_mutex_unlock(&repliesMutex);
+	return replies;
+}
+
 qpid::types::Variant::Map agocontrol::AgoConnection::sendMessageReply(const char *subject, qpid::types::Variant::Map content) {
-        Message message;
+	Message message;
 	qpid::types::Variant::Map responseMap;
-	Receiver responseReceiver;
-        try {
-                encode(content, message);
-                message.setSubject(subject);
-		Address responseQueue("#response-queue; {create:always, delete:always}");
-		responseReceiver = session.createReceiver(responseQueue);
-		message.setReplyTo(responseQueue);
-		sender.send(message);
-                Message response = responseReceiver.fetch(Duration::SECOND * 3);
-		session.acknowledge();
-                if (response.getContentSize() > 3) {
-                        decode(response,responseMap);
-                } else {
-			responseMap["response"] = response.getContent();
-		}
-        } catch (qpid::messaging::NoMessageAvailable) {
-                printf("WARNING, no reply message to fetch\n");
-        } catch(const std::exception& error) {
-                std::cerr << error.what() << std::endl;
-        }
 	try {
-		responseReceiver.close();
-        } catch(const std::exception& error) {
-                std::cerr << error.what() << std::endl;
-        }
-        return responseMap;
+		encode(content, message);
+		message.setSubject(subject);
+		Message response;
+		if (batchEvents) flushEvents(); // the request must not overtake events emitted before it
+		if (getReplyMultiplexer()->request(sender, message, response, Duration::SECOND * 3)) {
+			if (response.getContentSize() > 3) {
+				decode(response,responseMap);
+			} else {
+				responseMap["response"] = response.getContent();
+			}
+		} else {
+			printf("WARNING, no reply message to fetch\n");
+		}
+	} catch(const std::exception& error) {
+		std::cerr << error.what() << std::endl;
+	}
+	return responseMap;
 }
 
 
@@ -640,36 +1997,147 @@ bool agocontrol::AgoConnection::emitEvent(const char *internalId, const char *ev
 	content["level"] = value;
 	content["unit"] = unit;
 	content["uuid"] = internalIdToUuid(internalId);
-	return sendMessage(eventType, content);
+	return queueEvent(eventType, content);
 }
 bool agocontrol::AgoConnection::emitEvent(const char *internalId, const char *eventType, float level, const char *unit) {
 	Variant::Map content;
 	content["level"] = level;
 	content["unit"] = unit;
 	content["uuid"] = internalIdToUuid(internalId);
-	return sendMessage(eventType, content);
+	return queueEvent(eventType, content);
 }
 bool agocontrol::AgoConnection::emitEvent(const char *internalId, const char *eventType, int level, const char *unit) {
 	Variant::Map content;
 	content["level"] = level;
 	content["unit"] = unit;
 	content["uuid"] = internalIdToUuid(internalId);
-	return sendMessage(eventType, content);
+	return queueEvent(eventType, content);
 }
 
 bool agocontrol::AgoConnection::emitEvent(const char *internalId, const char *eventType, qpid::types::Variant::Map _content) {
 	Variant::Map content;
 	content = _content;
 	content["uuid"] = internalIdToUuid(internalId);
-	return sendMessage(eventType, content);
+	return queueEvent(eventType, content);
+}
+
+bool agocontrol::AgoConnection::queueEvent(const char *subject, qpid::types::Variant::Map &content) {
+	if (!batchEvents) return sendMessage(subject, content);
+
+	bool full = false;
+	pthread_mutex_lock(&eventMutex);
+	std::string key;
+	if (coalesceEvents) {
+		key = content["uuid"].asString() + "/" + subject;
+		boost::unordered_map<std::string, size_t>::iterator it = queuedEventIndex.find(key);
+		if (it != queuedEventIndex.end()) {
+			// superseded value, replace it in place to keep the order of the others
+			eventQueue[it->second].content.swap(content);
+			pthread_mutex_unlock(&eventMutex);
+			return true;
+		}
+	}
+	eventQueue.push_back(QueuedEvent());
+	eventQueue.back().subject = subject;
+	eventQueue.back().content.swap(content);
+	if (coalesceEvents) queuedEventIndex[key] = eventQueue.size() - 1;
+	full = eventQueue.size() >= maxBatch;
+	pthread_mutex_unlock(&eventMutex);
+
+	// the buffer is bounded, a full batch is sent right away by the emitting thread
+	if (full) return flushEvents();
+	return true;
+}
+
+void agocontrol::AgoConnection::sendDirect(qpid::messaging::Message &message) {
+	// with batching on, queued events go first so the resolver sees e.g. a statechanged before the remove
+	if (batchEvents) flushEvents();
+	sender.send(message);
+}
+
+bool agocontrol::AgoConnection::flushEvents() {
+	bool result = true;
+	std::deque<QueuedEvent> batch;
+
+	pthread_mutex_lock(&flushMutex);
+	pthread_mutex_lock(&eventMutex);
+	batch.swap(eventQueue);
+	queuedEventIndex.clear();
+	pthread_mutex_unlock(&eventMutex);
+
+	for (std::deque<QueuedEvent>::iterator it = batch.begin(); it != batch.end(); it++) {
+		try {
+			Message event;
+			encode(it->content, event);
+			event.setSubject(it->subject);
+			sender.send(event, false);
+		} catch(const std::exception& error) {
+			std::cerr << error.what() << std::endl;
+			result = false;
+		}
+	}
+	pthread_mutex_unlock(&flushMutex);
+	return result;
+}
+
+void *agocontrol::AgoConnection::eventFlusher(void *param) {
+	AgoConnection *self = (AgoConnection *)param;
+	pthread_mutex_lock(&self->eventMutex);
+	while (self->batchEvents) {
+		struct timespec deadline;
+		deadlineFromNow(deadline, self->batchInterval);
+		pthread_cond_timedwait(&self->eventCond, &self->eventMutex, &deadline);
+		if (self->eventQueue.empty()) continue;
+		pthread_mutex_unlock(&self->eventMutex);
+		self->flushEvents();
+		pthread_mutex_lock(&self->eventMutex);
+	}
+	pthread_mutex_unlock(&self->eventMutex);
+	return NULL;
+}
+
+bool agocontrol::AgoConnection::setEventBatching(unsigned int maxEvents, unsigned int flushInterval, bool coalesce) {
+	pthread_mutex_lock(&eventMutex);
+	maxBatch = maxEvents > 0 ? maxEvents : 1;
+	batchInterval = flushInterval > 0 ? flushInterval : 1;
+	coalesceEvents = coalesce;
+	queuedEventIndex.clear();
+	if (coalesceEvents) {
+		for (size_t i = 0; i < eventQueue.size(); i++) {
+			queuedEventIndex[eventQueue[i].content["uuid"].asString() + "/" + eventQueue[i].subject] = i;
+		}
+	}
+	batchEvents = true;
+	pthread_mutex_unlock(&eventMutex);
+
+	try {
+		// allow a whole batch to be in flight without blocking on the broker
+		if (sender.getCapacity() < maxBatch) sender.setCapacity(maxBatch);
+	} catch(const std::exception& error) {
+		std::cerr << error.what() << std::endl;
+	}
+	if (!flushThreadRunning) {
+		if (pthread_create(&flushThread, NULL, eventFlusher, this) != 0) {
+			printf("could not start event flush thread, sending events directly\n");
+			batchEvents = false;
+			return false;
+		}
+		flushThreadRunning = true;
+	}
+	return true;
 }
 
 string agocontrol::AgoConnection::getDeviceType(const char *internalId) {
+	string result;
+	pthread_mutex_lock(&deviceMutex);
 	string uuid = internalIdToUuid(internalId);
-	if (uuid.size() > 0) {
-		Variant::Map device = deviceMap[internalIdToUuid(internalId)].asMap();
-		return device["devicetype"];
-	} else return "";
+	Variant::Map::const_iterator it = deviceMap.find(uuid);
+	if (uuid.size() > 0 && it != deviceMap.end() && !it->second.isVoid()) {
+		Variant::Map::const_iterator devicetype = it->second.asMap().find("devicetype");
+		if (devicetype != it->second.asMap().end()) result = devicetype->second.asString();
+	}
+	pthread_mutex_unlock(&deviceMutex);
+	return result;
 
 }
 bool agocontrol::AgoConnection::setFilter(bool filter) {
@@ -688,27 +2156,45 @@ qpid::types::Variant::Map agocontrol::AgoConnection::getInventory() {
 	content["command"] = "inventory";
 	Message message;
 	encode(content, message);
-	Address responseQueue("#response-queue; {create:always, delete:always}");
-	Receiver responseReceiver = session.createReceiver(responseQueue);
-	message.setReplyTo(responseQueue);
-	sender.send(message);
 	try {
-		Message response = responseReceiver.fetch(Duration::SECOND * 3);
-		session.acknowledge();
-		if (response.getContentSize() > 3) {	
-			decode(response,responseMap);
+		Message response;
+		if (getReplyMultiplexer()->request(sender, message, response, Duration::SECOND * 3)) {
+			if (response.getContentSize() > 3) {
+				decode(response,responseMap);
+			}
+		} else {
+			printf("WARNING, no reply message to fetch\n");
 		}
-	} catch (qpid::messaging::NoMessageAvailable) {
-		printf("WARNING, no reply message to fetch\n");
+	} catch(const std::exception& error) {
+		std::cerr << error.what() << std::endl;
 	}
-	try {
-		responseReceiver.close();
-        } catch(const std::exception& error) {
-                std::cerr << error.what() << std::endl;
-        }
 	return responseMap;
 }
 
+agocontrol::InventoryCache *agocontrol::AgoConnection::getInventoryCache() {
+	pthread_mutex_lock(&inventoryCacheMutex);
+	if (inventoryCache == NULL) {
+		inventoryResync = atoi(getConfigOption(instance.c_str(), "inventoryresync", getConfigOption("system", "inventoryresync", "60").c_str()).c_str());
+		inventoryCache = new InventoryCache();
+	}
+	InventoryCache *cache = inventoryCache;
+	pthread_mutex_unlock(&inventoryCacheMutex);
+
+	if (cache->needsSync(inventoryResync)) {
+		Variant::Map content;
+		content["command"] = "getinventorydelta";
+		content["since"] = cache->getSequence();
+		content["epoch"] = cache->getEpoch();
+		content["schemaversion"] = cache->getSchemaVersion();
+		Variant::Map reply = sendMessageReply("", content);
+		// resolvers without delta support only answer the plain inventory request, no answer at all means
+		// the resolver is down and apply() backs off
+		if (!reply.empty() && reply.find("sequence") == reply.end()) reply = getInventory();
+		cache->apply(reply);
+	}
+	return cache;
+}
+
 std::string agocontrol::AgoConnection::getAgocontroller() {
 	std::string agocontroller;
 	int retry = 10;
@@ -780,3 +2266,163 @@ std::ostream& agocontrol::operator<< (std::ostream& os, const agocontrol::LogPri
     return os;
 }
 
+
+#ifdef UUIDMAP_BENCH
+// g++ -DUUIDMAP_BENCH -I. -I/usr/include/jsoncpp agoclient.cpp CDataFile.cpp -lqpidmessaging -lqpidtypes -luuid -ljsoncpp -lpthread
+// cost of the uuid lookup done for every emitted event, the former scan of uuidMap against the hash index
+// AgoConnection keeps (same structures as rebuildUuidIndex), for 100, 1000 and 10000 mappings
+
+static std::string legacyInternalIdToUuid(const qpid::types::Variant::Map &uuidMap, std::string internalId) {
+	string result;
+	for (Variant::Map::const_iterator it = uuidMap.begin(); it != uuidMap.end(); ++it) {
+		if (it->second.asString() == internalId) return it->first;
+	}
+	return result;
+}
+
+static double elapsed(const struct timeval &start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0;
+}
+
+using namespace agocontrol;
+
+int main(int argc, char **argv) {
+	const int lookups = argc > 1 ? atoi(argv[1]) : 10000;
+	const int sizes[] = { 100, 1000, 10000 };
+	for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+		Variant::Map uuidMap;
+		boost::unordered_map<std::string, std::string> internalIdIndex;
+		for (int i = 0; i < sizes[s]; i++) uuidMap[generateUuid()] = int2str(i) + "/1";
+		internalIdIndex.rehash(uuidMap.size());
+		for (Variant::Map::const_iterator it = uuidMap.begin(); it != uuidMap.end(); ++it) {
+			internalIdIndex.insert(std::make_pair(it->second.asString(), it->first));
+		}
+
+		// emitEvent(): resolve the uuid and build the event content
+		struct timeval start;
+		size_t found = 0;
+		gettimeofday(&start, NULL);
+		for (int i = 0; i < lookups; i++) {
+			Variant::Map content;
+			content["level"] = i;
+			content["unit"] = "";
+			content["uuid"] = legacyInternalIdToUuid(uuidMap, int2str(i % sizes[s]) + "/1");
+			found += content["uuid"].asString().size() > 0;
+		}
+		double legacy = elapsed(start) * 1000.0 / lookups;
+
+		gettimeofday(&start, NULL);
+		for (int i = 0; i < lookups; i++) {
+			Variant::Map content;
+			content["level"] = i;
+			content["unit"] = "";
+			boost::unordered_map<std::string, std::string>::const_iterator it = internalIdIndex.find(int2str(i % sizes[s]) + "/1");
+			content["uuid"] = it != internalIdIndex.end() ? it->second : "";
+			found += content["uuid"].asString().size() > 0;
+		}
+		double indexed = elapsed(start) * 1000.0 / lookups;
+
+		std::cout << sizes[s] << " mappings: scan " << legacy << " us, index " << indexed << " us per event" << std::endl;
+		if (found != 2 * (size_t)lookups) return 1;
+	}
+	return 0;
+}
+#endif
+
+#ifdef JSON_BENCH
+// g++ -DJSON_BENCH -I. -I/usr/include/jsoncpp agoclient.cpp CDataFile.cpp -lqpidmessaging -lqpidtypes -luuid -ljsoncpp -lpthread
+// compares the streaming writer with the former copy-and-concatenate implementation on a 2000 device inventory
+
+static std::string legacyMapToJSON(qpid::types::Variant::Map map);
+
+static std::string legacyListToJSON(qpid::types::Variant::List list) {
+	string result = "[";
+	for (Variant::List::const_iterator it = list.begin(); it != list.end(); ++it) {
+		std::string tmpstring;
+		if (it != list.begin()) result += ",";
+		switch(it->getType()) {
+			case VAR_MAP: result += legacyMapToJSON(it->asMap()); break;
+			case VAR_LIST: result += legacyListToJSON(it->asList()); break;
+			case VAR_STRING:
+				tmpstring = it->asString();
+				agocontrol::replaceString(tmpstring, "\"", "\\\"");
+				result += "\"" + tmpstring + "\"";
+				break;
+			default: result += it->asString().size() != 0 ? it->asString() : "null";
+		}
+	}
+	return result + "]";
+}
+
+static std::string legacyMapToJSON(qpid::types::Variant::Map map) {
+	string result = "{";
+	for (Variant::Map::const_iterator it = map.begin(); it != map.end(); ++it) {
+		std::string tmpstring;
+		if (it != map.begin()) result += ",";
+		result += "\"" + it->first + "\":";
+		switch (it->second.getType()) {
+			case VAR_MAP: result += legacyMapToJSON(it->second.asMap()); break;
+			case VAR_LIST: result += legacyListToJSON(it->second.asList()); break;
+			case VAR_STRING:
+				tmpstring = it->second.asString();
+				agocontrol::replaceString(tmpstring, "\"", "\\\"");
+				result += "\"" + tmpstring + "\"";
+				break;
+			default: result += it->second.asString().size() != 0 ? it->second.asString() : "null";
+		}
+	}
+	return result + "}";
+}
+
+static double elapsed(const struct timeval &start) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start.tv_sec) * 1000.0 + (now.tv_usec - start.tv_usec) / 1000.0;
+}
+
+using namespace agocontrol;
+
+int main(int argc, char **argv) {
+	Variant::Map devices;
+	for (int i = 0; i < 2000; i++) {
+		Variant::Map device;
+		Variant::Map values;
+		Variant::Map temperature;
+		temperature["level"] = 21.5 + i % 10;
+		temperature["unit"] = "degC";
+		temperature["timestamp"] = int2str(1380000000 + i);
+		values["temperature"] = temperature;
+		device["devicetype"] = "multilevelsensor";
+		device["internalid"] = int2str(i) + "/1";
+		device["handled-by"] = "zwave";
+		device["name"] = "sensor \"" + int2str(i) + "\"";
+		device["room"] = generateUuid();
+		device["state"] = "0";
+		device["lastseen"] = (uint64_t)1380000000;
+		device["stale"] = 0;
+		device["values"] = values;
+		devices[generateUuid()] = device;
+	}
+	Variant::Map inventory;
+	inventory["devices"] = devices;
+
+	const int rounds = argc > 1 ? atoi(argv[1]) : 20;
+	struct timeval start;
+	size_t size = 0;
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < rounds; i++) size += legacyMapToJSON(inventory).size();
+	double legacy = elapsed(start) / rounds;
+
+	gettimeofday(&start, NULL);
+	for (int i = 0; i < rounds; i++) size += variantMapToJSONString(inventory).size();
+	double streaming = elapsed(start) / rounds;
+
+	std::cout << "inventory JSON: " << variantMapToJSONString(inventory).size() << " bytes" << std::endl;
+	std::cout << "legacy:    " << legacy << " ms" << std::endl;
+	std::cout << "streaming: " << streaming << " ms" << std::endl;
+	return size > 0 ? 0 : 1;
+}
+#endif